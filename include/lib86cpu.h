@@ -37,6 +37,8 @@ using logfn_t = void(*)(log_level, const unsigned, const char *, ...);
 
 #define CPU_INTEL_SYNTAX        (1 << 1)
 #define CPU_DBG_PRESENT         (1 << 11)
+#define CPU_TRACE_BLOCKS        (1 << 12)
+#define CPU_TIERED_JIT          (1 << 13)
 
 // mmio/pmio access handlers
 using fp_read8 = uint8_t(*)(addr_t addr, void *opaque);
@@ -72,6 +74,8 @@ API_FUNC lc86_status cpu_run(cpu_t *cpu);
 API_FUNC void cpu_exit(cpu_t *cpu);
 API_FUNC void cpu_sync_state(cpu_t *cpu);
 API_FUNC lc86_status cpu_set_flags(cpu_t *cpu, uint32_t flags);
+API_FUNC lc86_status cpu_set_code_cache_budget(cpu_t *cpu, uint32_t max_tc, size_t max_code_size);
+API_FUNC lc86_status cpu_set_tc_file(cpu_t *cpu, const char *path);
 API_FUNC void cpu_set_a20(cpu_t *cpu, bool closed, bool should_int = false);
 API_FUNC void cpu_pause(cpu_t *cpu, bool should_wait);
 API_FUNC void cpu_wait_for_pause(cpu_t *cpu);
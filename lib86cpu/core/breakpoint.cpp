@@ -5,6 +5,7 @@
  */
 
 #include "internal.h"
+#include "memory.h"
 #include "breakpoint.h"
 
 
@@ -81,7 +82,7 @@ cpu_check_data_watchpoints(cpu_t *cpu, addr_t addr, size_t size, int type, uint3
 {
 	// if TLB_WATCH is not set, then there cannot be any watchpoints on this page, so we can skip checking for them entirely
 
-	if ((cpu->cpu_ctx.tlb[addr >> PAGE_SHIFT]) & TLB_WATCH) {
+	if (tlb_read(cpu, addr >> PAGE_SHIFT) & TLB_WATCH) {
 		cpu_check_watchpoints(cpu, addr, size, type, eip);
 	}
 }
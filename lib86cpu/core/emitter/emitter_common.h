@@ -14,8 +14,22 @@
 #define CPU_CTX_EFLAGS_AUX   offsetof(cpu_ctx_t, lazy_eflags.auxbits)
 #define CPU_CTX_EFLAGS_PAR   offsetof(cpu_ctx_t, lazy_eflags.parity)
 #define CPU_CTX_TLB          offsetof(cpu_ctx_t, tlb)
+#define CPU_CTX_TLB_ADDEND   offsetof(cpu_ctx_t, tlb_addend)
+#define CPU_CTX_RAM          offsetof(cpu_ctx_t, ram)
 #define CPU_CTX_EXP          offsetof(cpu_ctx_t, exp_info)
 #define CPU_CTX_INT          offsetof(cpu_ctx_t, int_pending)
+#define CPU_CTX_HFLG         offsetof(cpu_ctx_t, hflags)
+#define CPU_CTX_IBTC_PC      offsetof(cpu_ctx_t, ibtc[0].virt_pc)
+#define CPU_CTX_IBTC_CS_BASE offsetof(cpu_ctx_t, ibtc[0].cs_base)
+#define CPU_CTX_IBTC_FLAGS   offsetof(cpu_ctx_t, ibtc[0].cpu_flags)
+#define CPU_CTX_IBTC_CODE    offsetof(cpu_ctx_t, ibtc[0].ptr_code)
+#define CPU_CTX_RSB_PC       offsetof(cpu_ctx_t, rsb[0].virt_pc)
+#define CPU_CTX_RSB_CS_BASE  offsetof(cpu_ctx_t, rsb[0].cs_base)
+#define CPU_CTX_RSB_FLAGS    offsetof(cpu_ctx_t, rsb[0].cpu_flags)
+#define CPU_CTX_RSB_CODE     offsetof(cpu_ctx_t, rsb[0].ptr_code)
+#define CPU_CTX_RSB_TOP      offsetof(cpu_ctx_t, rsb_top)
+#define CPU_CTX_SMC          offsetof(cpu_ctx_t, smc)
+#define CPU_CTX_SMC_PAGE     offsetof(cpu_ctx_t, smc_first_page)
 
 #define CPU_CTX_EAX          offsetof(cpu_ctx_t, regs.eax)
 #define CPU_CTX_ECX          offsetof(cpu_ctx_t, regs.ecx)
@@ -102,6 +116,7 @@
 
 
 entry_t link_indirect_handler(cpu_ctx_t *cpu_ctx, translated_code_t *tc);
+void rsb_push_handler(cpu_ctx_t *cpu_ctx, translated_code_t *tc, addr_t ret_pc);
 size_t get_reg_offset(ZydisRegister reg);
 size_t get_seg_prfx_offset(ZydisDecodedInstruction *instr);;
 int get_reg_idx(ZydisRegister reg);
@@ -10,6 +10,7 @@
 #include "debugger.h"
 #include <assert.h>
 #include <optional>
+#include <algorithm>
 
 #ifdef LIB86CPU_X64_EMITTER
 
@@ -139,6 +140,10 @@ static const std::unordered_map<x64, x86::Gp> reg_to_sized_reg = {
 	{ x64::r11 | SIZE32,  R11D },
 };
 
+// host regs that can hold a guest gpr for the duration of a tc. These are all callee-saved, but they are saved only once by run_code() before
+// entering the translated code, so that the tc's don't need to save them in their prologue
+static const x86::Gp ra_host_regs[RA_NUM_HOST_REGS] = { RSI, RDI, RBP, R12, R13, R14, R15 };
+
 size_t
 get_local_var_offset(size_t idx)
 {
@@ -236,6 +241,7 @@ get_local_var_offset()
 #define CLC() m_a.clc()
 #define STC() m_a.stc()
 #define CALL(addr) m_a.call(addr)
+#define CALL_F(fn) call_helper_emit(reinterpret_cast<const void *>(fn))
 #define RET() m_a.ret()
 #define PUSH(dst) m_a.push(dst)
 #define POP(dst) m_a.pop(dst)
@@ -272,18 +278,18 @@ get_local_var_offset()
 #define CMOV_EQ(dst, src) m_a.cmove(dst, src)
 #define CMOV_NE(dst, src) m_a.cmovne(dst, src)
 
-#define LD_R8L(dst, reg_offset) MOV(dst, MEMD8(RCX, reg_offset))
-#define LD_R8H(dst, reg_offset) MOV(dst, MEMD8(RCX, reg_offset + 1))
-#define LD_R16(dst, reg_offset) MOV(dst, MEMD16(RCX, reg_offset))
-#define LD_R32(dst, reg_offset) MOV(dst, MEMD32(RCX, reg_offset))
+#define LD_R8L(dst, reg_offset) load_reg(dst, reg_offset, SIZE8)
+#define LD_R8H(dst, reg_offset) load_reg(dst, reg_offset + 1, SIZE8)
+#define LD_R16(dst, reg_offset) load_reg(dst, reg_offset, SIZE16)
+#define LD_R32(dst, reg_offset) load_reg(dst, reg_offset, SIZE32)
 #define LD_REG_val(dst, reg_offset, size) load_reg(dst, reg_offset, size)
 #define LD_SEG(dst, seg_offset) MOV(dst, MEMD16(RCX, seg_offset))
 #define LD_SEG_BASE(dst, seg_offset) MOV(dst, MEMD32(RCX, seg_offset + seg_base_offset))
 #define LD_SEG_LIMIT(dst, seg_offset) MOV(dst, MEMD32(RCX, seg_offset + seg_limit_offset))
-#define ST_R8L(reg_offset, src) MOV(MEMD8(RCX, reg_offset), src)
-#define ST_R8H(reg_offset, src) MOV(MEMD8(RCX, reg_offset + 1), src)
-#define ST_R16(reg_offset, src) MOV(MEMD16(RCX, reg_offset), src)
-#define ST_R32(reg_offset, src) MOV(MEMD32(RCX, reg_offset), src)
+#define ST_R8L(reg_offset, src) store_reg(src, reg_offset, SIZE8)
+#define ST_R8H(reg_offset, src) store_reg(src, reg_offset + 1, SIZE8)
+#define ST_R16(reg_offset, src) store_reg(src, reg_offset, SIZE16)
+#define ST_R32(reg_offset, src) store_reg(src, reg_offset, SIZE32)
 #define ST_REG_val(val, reg_offset, size) store_reg(val, reg_offset, size)
 #define ST_SEG(seg_offset, val) MOV(MEMD16(RCX, seg_offset), val)
 #define ST_SEG_BASE(seg_offset, val) MOV(MEMD32(RCX, seg_offset + seg_base_offset), val)
@@ -316,7 +322,8 @@ get_local_var_offset()
 #define GET_OP(op) get_operand(instr, op)
 #define GET_IMM() get_immediate_op(instr, OPNUM_SRC)
 
-#define RELOAD_RCX_CTX() MOV(RCX, &m_cpu->cpu_ctx)
+#define MOV_PTR(dst, ptr) mov_ptr_emit(dst, reinterpret_cast<const void *>(ptr))
+#define RELOAD_RCX_CTX() MOV_PTR(RCX, &m_cpu->cpu_ctx)
 
 
 lc86_jit::lc86_jit(cpu_t *cpu)
@@ -324,6 +331,7 @@ lc86_jit::lc86_jit(cpu_t *cpu)
 	m_cpu = cpu;
 	_environment = Environment::host();
 	_environment.setObjectFormat(ObjectFormat::kJIT);
+	reg_alloc_reset();
 	gen_int_fn();
 }
 
@@ -333,13 +341,13 @@ lc86_jit::start_new_session()
 	m_code.reset();
 	m_code.init(_environment);
 	m_code.attach(m_a.as<BaseEmitter>());
+	m_helper_calls.clear();
+	m_ptr_movs.clear();
 }
 
 void
 lc86_jit::gen_code_block()
 {
-	translated_code_t *tc = m_cpu->tc;
-
 	if (auto err = m_code.flatten()) {
 		std::string err_str("Asmjit failed at flatten() with the error ");
 		err_str += DebugUtils::errorAsString(err);
@@ -357,6 +365,44 @@ lc86_jit::gen_code_block()
 		throw lc86_exp_abort("The generated code has a zero size", lc86_status::internal_error);
 	}
 
+	mem_block block = alloc_code_block(estimated_code_size);
+
+	if (auto err = m_code.relocateToBase(reinterpret_cast<uintptr_t>(block.addr))) {
+		std::string err_str("Asmjit failed at relocateToBase() with the error ");
+		err_str += DebugUtils::errorAsString(err);
+		throw lc86_exp_abort(err_str, lc86_status::internal_error);
+	}
+
+	// NOTE: there should only be a single .text section
+	assert(m_code.sectionCount() == 1);
+
+	Section *section = m_code.textSection();
+	size_t offset = static_cast<size_t>(section->offset()); // should be zero for the first section
+	size_t buff_size = static_cast<size_t>(section->bufferSize());
+
+	assert(offset + buff_size <= block.size);
+	uint8_t *main_offset = static_cast<uint8_t *>(block.addr) + offset;
+	std::memcpy(main_offset, section->data(), buff_size);
+
+	// Now that the final address of the code is known, fix up the displacements of the calls to the helpers
+	for (const auto &[ret_label, fn] : m_helper_calls) {
+		fix_helper_call(main_offset + m_code.labelOffset(ret_label), fn);
+	}
+
+	uint32_t jmp_rel32[2];
+	for (unsigned i = 0; i < 2; ++i) {
+		jmp_rel32[i] = m_jmp_label[i].isValid() ? static_cast<uint32_t>(m_code.labelOffset(m_jmp_label[i]) - 4) : TC_CODE_NO_JMP;
+	}
+
+	// According to asmjit's source code, the code size can decrease after the relocation above, so we need to query it again
+	finish_code_block(block, main_offset, m_code.codeSize(), jmp_rel32);
+}
+
+mem_block
+lc86_jit::alloc_code_block(size_t code_size)
+{
+	size_t estimated_code_size = code_size;
+
 #if defined(_WIN64)
 	// Increase estimated_code_size by 12 + 12, to accomodate the .pdata and .xdata sections required to unwind the function
 	// when an exception is thrown. Note that the sections need to be DWORD aligned
@@ -373,29 +419,29 @@ lc86_jit::gen_code_block()
 	if (!block.addr) {
 		throw lc86_exp_abort("Failed to allocate memory for the generated code", lc86_status::no_memory);
 	}
+	m_cpu->tc->code_size = static_cast<uint32_t>(block.size);
 
-	if (auto err = m_code.relocateToBase(reinterpret_cast<uintptr_t>(block.addr))) {
-		std::string err_str("Asmjit failed at relocateToBase() with the error ");
-		err_str += DebugUtils::errorAsString(err);
-		throw lc86_exp_abort(err_str, lc86_status::internal_error);
-	}
-
-	// NOTE: there should only be a single .text section
-	assert(m_code.sectionCount() == 1);
+	return block;
+}
 
-	Section *section = m_code.textSection();
-	size_t offset = static_cast<size_t>(section->offset()); // should be zero for the first section
-	size_t buff_size = static_cast<size_t>(section->bufferSize());
+void
+lc86_jit::fix_helper_call(uint8_t *ret_addr, const void *fn)
+{
+	// the target was already resolved when the call was emitted or loaded, so this can't fail
+	const uint8_t *target = get_helper_target(fn);
+	assert(target);
+	*reinterpret_cast<int32_t *>(ret_addr - 4) = static_cast<int32_t>(target - ret_addr);
+}
 
-	assert(offset + buff_size <= estimated_code_size);
-	uint8_t *main_offset = static_cast<uint8_t *>(block.addr) + offset;
-	std::memcpy(main_offset, section->data(), buff_size);
+void
+lc86_jit::finish_code_block(const mem_block &block, uint8_t *main_offset, size_t code_size, const uint32_t *jmp_rel32)
+{
+	translated_code_t *tc = m_cpu->tc;
 
 #if defined(_WIN64)
-	// According to asmjit's source code, the code size can decrease after the relocation above, so we need to query it again
-	uint8_t *exit_offset = gen_exception_info(main_offset, m_code.codeSize());
+	uint8_t *exit_offset = gen_exception_info(main_offset, code_size);
 #else
-	uint8_t *exit_offset = static_cast<uint8_t *>(block.addr) + offset + buff_size;
+	uint8_t *exit_offset = main_offset + code_size;
 #endif
 
 	exit_offset = reinterpret_cast<uint8_t *>((reinterpret_cast<uintptr_t>(exit_offset) + 15) & ~15);
@@ -425,6 +471,105 @@ lc86_jit::gen_code_block()
 
 	tc->ptr_code = reinterpret_cast<entry_t>(main_offset);
 	tc->jmp_offset[0] = tc->jmp_offset[1] = tc->jmp_offset[2] = reinterpret_cast<entry_t>(exit_offset);
+	for (unsigned i = 0; i < 2; ++i) {
+		tc->jmp_rel32[i] = (jmp_rel32[i] != TC_CODE_NO_JMP) ? main_offset + jmp_rel32[i] : nullptr;
+	}
+}
+
+bool
+lc86_jit::get_code_block(tc_code_t &code)
+{
+	// Describes the code just generated by gen_code_block independently of where it is, for the persistent translation cache. The pointers loaded by
+	// mov_ptr_emit become offsets from the cpu_t, from the tc or from the base of the library, and the helpers become offsets from the base of the library.
+	// This fails when a pointer is in none of them, like a host buffer allocated at runtime, since then the tc can't be reused by another run.
+	// NOTE: this must be called before the next session starts, and it doesn't support the tc's that call hooks, since those are outside of the library
+
+	translated_code_t *tc = m_cpu->tc;
+	const uint8_t *lib_base = mem_manager::get_lib_base();
+	const uint8_t *lib_end = lib_base + mem_manager::get_lib_size();
+	Section *section = m_code.textSection();
+	code.code.assign(section->data(), section->data() + section->bufferSize());
+	code.code_size = static_cast<uint32_t>(m_code.codeSize());
+	for (unsigned i = 0; i < 2; ++i) {
+		code.jmp_rel32[i] = m_jmp_label[i].isValid() ? static_cast<uint32_t>(m_code.labelOffset(m_jmp_label[i]) - 4) : TC_CODE_NO_JMP;
+	}
+
+	code.relocs.clear();
+	for (const auto &[ret_label, fn] : m_helper_calls) {
+		const uint8_t *fn8 = static_cast<const uint8_t *>(fn);
+		if ((fn8 < lib_base) || (fn8 >= lib_end)) {
+			return false;
+		}
+		code.relocs.emplace_back(static_cast<uint32_t>(m_code.labelOffset(ret_label)), tc_reloc_t::call, fn8 - lib_base);
+	}
+	for (const auto &[end_label, ptr] : m_ptr_movs) {
+		const uint8_t *ptr8 = static_cast<const uint8_t *>(ptr);
+		uint32_t offset = static_cast<uint32_t>(m_code.labelOffset(end_label));
+		if ((ptr8 >= reinterpret_cast<const uint8_t *>(m_cpu)) && (ptr8 < reinterpret_cast<const uint8_t *>(m_cpu + 1))) {
+			code.relocs.emplace_back(offset, tc_reloc_t::cpu, ptr8 - reinterpret_cast<const uint8_t *>(m_cpu));
+		}
+		else if ((ptr8 >= reinterpret_cast<const uint8_t *>(tc)) && (ptr8 < reinterpret_cast<const uint8_t *>(tc + 1))) {
+			code.relocs.emplace_back(offset, tc_reloc_t::tc, ptr8 - reinterpret_cast<const uint8_t *>(tc));
+		}
+		else if ((ptr8 >= lib_base) && (ptr8 < lib_end)) {
+			code.relocs.emplace_back(offset, tc_reloc_t::lib, ptr8 - lib_base);
+		}
+		else {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool
+lc86_jit::load_code_block(const tc_code_t &code)
+{
+	// Installs the code of the tc from its description made by get_code_block in a previous run, by applying its relocations against the current cpu_t,
+	// tc and library. This fails if a relocation points outside of the library, or if a helper can't be called anymore, because the stub table is full
+
+	const uint8_t *lib_base = mem_manager::get_lib_base();
+	size_t lib_size = mem_manager::get_lib_size();
+	for (const auto &reloc : code.relocs) {
+		if (((reloc.type == tc_reloc_t::call) || (reloc.type == tc_reloc_t::lib)) && (reloc.val >= lib_size)) {
+			return false;
+		}
+		if ((reloc.type == tc_reloc_t::call) && (get_helper_target(lib_base + reloc.val) == nullptr)) {
+			return false;
+		}
+	}
+
+	mem_block block = alloc_code_block(code.code.size());
+	uint8_t *main_offset = static_cast<uint8_t *>(block.addr);
+	std::memcpy(main_offset, code.code.data(), code.code.size());
+
+	for (const auto &reloc : code.relocs) {
+		uint8_t *addr = main_offset + reloc.offset;
+		switch (reloc.type)
+		{
+		case tc_reloc_t::call:
+			fix_helper_call(addr, lib_base + reloc.val);
+			break;
+
+		case tc_reloc_t::cpu:
+			*reinterpret_cast<uint64_t *>(addr - 8) = reinterpret_cast<uintptr_t>(m_cpu) + reloc.val;
+			break;
+
+		case tc_reloc_t::tc:
+			*reinterpret_cast<uint64_t *>(addr - 8) = reinterpret_cast<uintptr_t>(m_cpu->tc) + reloc.val;
+			break;
+
+		case tc_reloc_t::lib:
+			*reinterpret_cast<uint64_t *>(addr - 8) = reinterpret_cast<uintptr_t>(lib_base) + reloc.val;
+			break;
+
+		default:
+			LIB86CPU_ABORT();
+		}
+	}
+
+	finish_code_block(block, main_offset, code.code_size, code.jmp_rel32);
+	return true;
 }
 
 void
@@ -490,6 +635,78 @@ lc86_jit::gen_int_fn(bool is_raise)
 	}
 }
 
+void
+lc86_jit::gen_run_code_fn()
+{
+	// run_code() is the only entry point of the translated code. It saves the callee-saved host regs that the tc's use to cache the guest regs, and
+	// then calls the tc, whose address is in RDX. The tc's return here either with a ret or with the exit function
+
+	start_new_session();
+
+	for (const auto &reg : ra_host_regs) {
+		PUSH(reg);
+	}
+	SUB(RSP, get_jit_reg_args_size());
+	CALL(RDX);
+	ADD(RSP, get_jit_reg_args_size());
+	for (int i = RA_NUM_HOST_REGS - 1; i >= 0; --i) {
+		POP(ra_host_regs[i]);
+	}
+	RET();
+
+	if (auto err = m_code.flatten()) {
+		std::string err_str("Asmjit failed at flatten() with the error ");
+		err_str += DebugUtils::errorAsString(err);
+		throw lc86_exp_abort(err_str, lc86_status::internal_error);
+	}
+
+	if (auto err = m_code.resolveUnresolvedLinks()) {
+		std::string err_str("Asmjit failed at resolveUnresolvedLinks() with the error ");
+		err_str += DebugUtils::errorAsString(err);
+		throw lc86_exp_abort(err_str, lc86_status::internal_error);
+	}
+
+	size_t estimated_code_size = m_code.codeSize();
+	if (estimated_code_size == 0) {
+		throw lc86_exp_abort("The generated code has a zero size", lc86_status::internal_error);
+	}
+
+#if defined(_WIN64)
+	// This is not a leaf function, so it needs the .pdata and .xdata sections too. Increase estimated_code_size by 4 + 16 + 12 to accomodate them
+	estimated_code_size = (estimated_code_size + 3) & ~3;
+	estimated_code_size += 32;
+#endif
+
+	auto block = m_mem.allocate_sys_mem(estimated_code_size);
+	if (!block.addr) {
+		throw lc86_exp_abort("Failed to allocate memory for the generated code", lc86_status::no_memory);
+	}
+
+	if (auto err = m_code.relocateToBase(reinterpret_cast<uintptr_t>(block.addr))) {
+		std::string err_str("Asmjit failed at relocateToBase() with the error ");
+		err_str += DebugUtils::errorAsString(err);
+		throw lc86_exp_abort(err_str, lc86_status::internal_error);
+	}
+
+	assert(m_code.sectionCount() == 1);
+
+	Section *section = m_code.textSection();
+	size_t offset = static_cast<size_t>(section->offset());
+	size_t buff_size = static_cast<size_t>(section->bufferSize());
+
+	assert(offset + buff_size <= estimated_code_size);
+	uint8_t *main_offset = static_cast<uint8_t *>(block.addr) + offset;
+	std::memcpy(main_offset, section->data(), buff_size);
+
+#if defined(_WIN64)
+	gen_run_code_exception_info(main_offset, m_code.codeSize());
+#endif
+
+	m_mem.protect_sys_mem(block, MEM_READ | MEM_EXEC);
+
+	m_cpu->run_code_fn = reinterpret_cast<run_code_t>(main_offset);
+}
+
 void
 lc86_jit::gen_prologue_main()
 {
@@ -501,8 +718,8 @@ lc86_jit::gen_prologue_main()
 	// RCX always holds the cpu_ctx arg, and should never be changed. If you still need to (e.g. after a call to an external function), you should always restore it
 	// immediately after with a MOV rcx, &m_cpu->cpu_ctx, since the cu_ctx is a constant and never changes at runtime while the emulatio is running. Prologue and
 	// epilog always push and pop RBX, so it's volatile too. Prefer using RAX, RDX, RBX over R8, R9, R10 and R11 to reduce the code size, and only use the host stack
-	// as a last resort. Calling external functions from main() must be done with CALL(RAX), and not with rip offsets, because the function can be farther than
-	// 4 GiB from the current code.
+	// as a last resort. Calling external functions from main() must be done with CALL_F, which emits a call rel32 to the function, or to its stub in the helper
+	// stub table when the function is farther than 2 GiB from the code arena, see call_helper_emit.
 	// Some optimizations used in the main() function:
 	// Offsets from cpu_ctx can be calculated with displacements, to avoid having to use additional ADD instructions. Local variables on the stack are always allocated
 	// at a fixed offset computed at compile time, and the shadow area to spill registers is available too (always allocated by the caller of the jitted function).
@@ -510,17 +727,43 @@ lc86_jit::gen_prologue_main()
 	// by one can be done with ADD reg, reg. Reading an 8/16 bit reg and then zero/sign extending to 32 can be done with a single MOVZ/SX reg, word/byte ptr [rcx, off] instead
 	// of MOV and then MOVZ/SX. Call external C++ helper functions to implement the most difficult instructions.
 
+	// The guest regs can also be cached in RSI, RDI, RBP and R12-R15 for the duration of the tc, see reg_alloc_instr. These don't need to be
+	// saved here, because run_code() does it
+
 	PUSH(RBX);
 	SUB(RSP, get_jit_stack_required());
 
 	m_needs_epilogue = true;
+	m_jmp_label[0] = m_jmp_label[1] = Label();
+	reg_alloc_reset();
+
+	// mark the tc as recently used for get_cold_tc. This is not repeated by the self loops, which jump to m_entry_label
+	MOV_PTR(RAX, &m_cpu->tc->referenced);
+	MOV(MEMD8(RAX, 0), 1);
+
+	m_entry_label = m_a.newLabel();
+	m_a.bind(m_entry_label);
+
+	if (m_cpu->tc->flags & TC_FLG_TIER0) {
+		// Count the runs of a tier 0 tc, including the iterations of its self loops. When it becomes hot, return to cpu_main_loop without running it, so
+		// that it's translated again with the full tier. Eip is always the start of the tc here, and no guest reg is cached yet
+		Label cold = m_a.newLabel();
+		MOV_PTR(RAX, &m_cpu->tc->num_exec);
+		SUB(MEMD32(RAX, 0), 1);
+		BR_SGT(cold);
+		XOR(EAX, EAX);
+		gen_epilogue_main<false>();
+		m_a.bind(cold);
+	}
 }
 
 template<bool set_ret>
 void lc86_jit::gen_epilogue_main()
 {
+	// when set_ret is false, we are returning after a call to a function that might have changed the guest regs, so they must not be written back
 	if constexpr (set_ret) {
-		MOV(RAX, m_cpu->tc);
+		reg_alloc_writeback_emit();
+		MOV_PTR(RAX, m_cpu->tc);
 	}
 	ADD(RSP, get_jit_stack_required());
 	POP(RBX);
@@ -530,11 +773,64 @@ void lc86_jit::gen_epilogue_main()
 void
 lc86_jit::gen_tail_call(x86::Gp addr)
 {
+	reg_alloc_writeback_emit();
 	ADD(RSP, get_jit_stack_required());
 	POP(RBX);
 	BR_UNCOND(addr);
 }
 
+void
+lc86_jit::gen_tail_call_direct(unsigned jmp_idx)
+{
+	// Emits a jmp rel32 that can be patched by patch_jmp to jump straight to the linked tc. Its displacement starts as zero, so that it falls through
+	// to the indirect jump through jmp_offset, which is used when the tc is not linked or when the linked tc is too far away for a rel32
+
+	static constexpr uint8_t jmp_buff[] = {
+		0xE9, // jmp rel32
+		0,
+		0,
+		0,
+		0,
+	};
+
+	assert(!m_jmp_label[jmp_idx].isValid());
+
+	reg_alloc_writeback_emit();
+	ADD(RSP, get_jit_stack_required());
+	POP(RBX);
+	m_a.embed(jmp_buff, sizeof(jmp_buff));
+	m_jmp_label[jmp_idx] = m_a.newLabel();
+	m_a.bind(m_jmp_label[jmp_idx]);
+	MOV_PTR(RDX, &m_cpu->tc->jmp_offset[jmp_idx]);
+	MOV(RAX, MEM64(RDX));
+	BR_UNCOND(RAX);
+}
+
+void
+lc86_jit::patch_jmp(translated_code_t *tc, unsigned jmp_idx, entry_t target)
+{
+	tc->jmp_offset[jmp_idx] = target;
+
+	if (uint8_t *rel32_addr = tc->jmp_rel32[jmp_idx]) {
+		// a zero displacement falls through to the indirect jump, which is also what we use when unlinking (target is the exit function)
+		int64_t disp = reinterpret_cast<uint8_t *>(target) - (rel32_addr + 4);
+		if ((target == tc->jmp_offset[2]) || (disp != static_cast<int32_t>(disp))) {
+			disp = 0;
+		}
+
+		// the chunk of the jmp stays RWX until end_patches, so that all the links and unlinks done in the meantime only change its protection once
+		m_mem.unprotect_for_patch(mem_block(rel32_addr, sizeof(int32_t)));
+		*reinterpret_cast<int32_t *>(rel32_addr) = static_cast<int32_t>(disp);
+	}
+}
+
+void
+lc86_jit::end_patches()
+{
+	// makes RX again the code patched by patch_jmp since the last call
+	m_mem.reprotect_patched();
+}
+
 void
 lc86_jit::gen_tc_epilogue()
 {
@@ -566,6 +862,103 @@ lc86_jit::gen_int_fn()
 {
 	gen_int_fn(false);
 	gen_int_fn(true);
+	gen_run_code_fn();
+	gen_helper_stubs();
+}
+
+void
+lc86_jit::gen_helper_stubs()
+{
+	// The stub table is only used by the helpers that can't be reached with a rel32 from the code arena, see call_helper_emit. The stubs are added lazily,
+	// because the helpers are only known when a call to them is emitted
+
+	m_helper_stubs.clear();
+	m_num_helper_stubs = 0;
+	m_helper_stub_block = m_mem.allocate_sys_mem(HELPER_STUB_TABLE_SIZE);
+	if (m_helper_stub_block.addr) {
+		m_mem.protect_sys_mem(m_helper_stub_block, MEM_READ | MEM_EXEC);
+	}
+}
+
+const uint8_t *
+lc86_jit::get_helper_stub(const void *fn)
+{
+	if (auto it = m_helper_stubs.find(fn); it != m_helper_stubs.end()) {
+		return it->second;
+	}
+
+	if ((m_helper_stub_block.addr == nullptr) || (m_num_helper_stubs == (HELPER_STUB_TABLE_SIZE / HELPER_STUB_SIZE))) {
+		return nullptr;
+	}
+
+	static constexpr uint8_t stub_buff[] = {
+		0xFF, // jmp qword ptr [rip + 0]
+		0x25,
+		0,
+		0,
+		0,
+		0,
+	};
+
+	uint8_t *stub = static_cast<uint8_t *>(m_helper_stub_block.addr) + m_num_helper_stubs * HELPER_STUB_SIZE;
+	m_mem.protect_sys_mem(m_helper_stub_block, MEM_READ | MEM_WRITE | MEM_EXEC);
+	std::memcpy(stub, stub_buff, sizeof(stub_buff));
+	*reinterpret_cast<uint64_t *>(stub + sizeof(stub_buff)) = reinterpret_cast<uintptr_t>(fn);
+	m_mem.protect_sys_mem(m_helper_stub_block, MEM_READ | MEM_EXEC);
+
+	++m_num_helper_stubs;
+	m_helper_stubs.emplace(fn, stub);
+	return stub;
+}
+
+void
+lc86_jit::call_helper_emit(const void *fn)
+{
+	// Emits a call rel32 to the helper, or to its stub if the helper is too far from the code arena. The displacement is fixed up by gen_code_block, after the
+	// code has been copied to its final address. If the stub table is full, this falls back to an indirect call
+
+	if (get_helper_target(fn) == nullptr) {
+		MOV_PTR(RAX, fn);
+		CALL(RAX);
+		return;
+	}
+
+	static constexpr uint8_t call_buff[] = {
+		0xE8, // call rel32
+		0,
+		0,
+		0,
+		0,
+	};
+
+	m_a.embed(call_buff, sizeof(call_buff));
+	Label ret_label = m_a.newLabel();
+	m_a.bind(ret_label);
+	m_helper_calls.emplace_back(ret_label, fn);
+}
+
+const uint8_t *
+lc86_jit::get_helper_target(const void *fn)
+{
+	// the helper itself if it can be reached with a rel32 from the code arena, otherwise its stub, or nullptr if the stub table is full
+	return m_mem.is_reachable(fn) ? static_cast<const uint8_t *>(fn) : get_helper_stub(fn);
+}
+
+void
+lc86_jit::mov_ptr_emit(x86::Gp dst, const void *ptr)
+{
+	// Emits a mov r64, imm64 that loads a host pointer, and remembers where the pointer is, so that get_code_block can describe it independently of the
+	// address it has in this run. The imm64 is always emitted, even when the pointer fits in 32 bits, so that it can be changed later by load_code_block
+
+	uint8_t mov_buff[10];
+	mov_buff[0] = 0x48 | (dst.id() >> 3); // rex.w, and rex.b for r8-r15
+	mov_buff[1] = 0xB8 | (dst.id() & 7);  // mov r64, imm64
+	std::memcpy(&mov_buff[2], &ptr, sizeof(ptr));
+
+	m_a.embed(mov_buff, sizeof(mov_buff));
+	Label end_label = m_a.newLabel();
+	m_a.bind(end_label);
+	m_ptr_movs.emplace_back(end_label, ptr);
 }
 
 template<bool terminates, typename T1, typename T2, typename T3, typename T4>
@@ -580,8 +973,8 @@ void lc86_jit::raise_exp_inline_emit(T1 fault_addr, T2 code, T3 idx, T4 eip)
 	MOV(MEMD16(RCX, CPU_EXP_CODE), code);
 	MOV(MEMD16(RCX, CPU_EXP_IDX), idx);
 	MOV(MEMD32(RCX, CPU_EXP_EIP), eip);
-	MOV(RAX, &cpu_raise_exception<>);
-	CALL(RAX);
+	reg_alloc_writeback_emit();
+	CALL_F(&cpu_raise_exception<>);
 	gen_epilogue_main<false>();
 }
 
@@ -593,16 +986,15 @@ void lc86_jit::raise_exp_inline_emit()
 		m_cpu->translate_next = 0;
 	}
 
-	MOV(RAX, &cpu_raise_exception<>);
-	CALL(RAX);
+	reg_alloc_writeback_emit();
+	CALL_F(&cpu_raise_exception<>);
 	gen_epilogue_main<false>();
 }
 
 void
 lc86_jit::hook_emit(void *hook_addr)
 {
-	MOV(RAX, reinterpret_cast<uintptr_t>(hook_addr));
-	CALL(RAX);
+	CALL_F(hook_addr);
 	RELOAD_RCX_CTX();
 
 	link_ret_emit();
@@ -626,8 +1018,8 @@ lc86_jit::check_int_emit()
 	OR(EAX, EDX);
 	CMP(EAX, 1); // hw int set but if=0
 	BR_EQ(no_int);
-	MOV(RAX, &cpu_do_int);
-	CALL(RAX);
+	reg_alloc_writeback_emit();
+	CALL_F(&cpu_do_int);
 	gen_epilogue_main<false>();
 	m_a.bind(no_int);
 }
@@ -685,6 +1077,19 @@ void lc86_jit::link_direct_emit(addr_t dst_pc, addr_t *next_pc, T target_pc)
 	// make sure we check for interrupts before jumping to the next tc
 	check_int_emit();
 
+	if constexpr (!std::is_integral_v<T>) {
+		if (next_pc && (dst_pc == m_cpu->tc->virt_pc)) {
+			// Back-edge of a loop to the start of this tc: when taken, jump right after the prologue instead of exiting and entering the tc again. The
+			// code there doesn't expect any guest reg to be cached, so they are written back first. The interrupt check above is still done on every iteration
+			Label not_taken = m_a.newLabel();
+			CMP(target_pc, dst_pc);
+			BR_NE(not_taken);
+			reg_alloc_writeback_emit();
+			BR_UNCOND(m_entry_label);
+			m_a.bind(not_taken);
+		}
+	}
+
 	// vec_addr: instr_pc, dst_pc, next_pc
 	addr_t page_addr = m_cpu->virt_pc & ~PAGE_MASK;
 	uint32_t n, dst = (dst_pc & ~PAGE_MASK) == page_addr;
@@ -705,16 +1110,14 @@ void lc86_jit::link_direct_emit(addr_t dst_pc, addr_t *next_pc, T target_pc)
 	case 1: {
 		if (next_pc) { // if(dst_pc) -> cond jmp dst_pc; if(next_pc) -> cond jmp next_pc
 			if (dst) {
-				MOV(RDX, &m_cpu->tc->flags);
+				MOV_PTR(RDX, &m_cpu->tc->flags);
 				MOV(EBX, MEM32(RDX));
 				MOV(EAX, ~TC_FLG_JMP_TAKEN);
 				AND(EAX, EBX);
 				if constexpr (std::is_integral_v<T>) {
 					if (target_pc == dst_pc) {
 						MOV(MEM32(RDX), EAX);
-						MOV(RDX, &m_cpu->tc->jmp_offset[0]);
-						MOV(RAX, MEM64(RDX));
-						gen_tail_call(RAX);
+						gen_tail_call_direct(0);
 					}
 					else {
 						OR(EAX, TC_JMP_RET << 4);
@@ -727,9 +1130,7 @@ void lc86_jit::link_direct_emit(addr_t dst_pc, addr_t *next_pc, T target_pc)
 					CMP(target_pc, dst_pc);
 					BR_NE(ret);
 					MOV(MEM32(RDX), EAX);
-					MOV(RDX, &m_cpu->tc->jmp_offset[0]);
-					MOV(RAX, MEM64(RDX));
-					gen_tail_call(RAX);
+					gen_tail_call_direct(0);
 					m_a.bind(ret);
 					OR(EAX, TC_JMP_RET << 4);
 					MOV(MEM32(RDX), EAX);
@@ -737,7 +1138,7 @@ void lc86_jit::link_direct_emit(addr_t dst_pc, addr_t *next_pc, T target_pc)
 				}
 			}
 			else {
-				MOV(RDX, &m_cpu->tc->flags);
+				MOV_PTR(RDX, &m_cpu->tc->flags);
 				MOV(EBX, MEM32(RDX));
 				MOV(EAX, ~TC_FLG_JMP_TAKEN);
 				AND(EAX, EBX);
@@ -745,9 +1146,7 @@ void lc86_jit::link_direct_emit(addr_t dst_pc, addr_t *next_pc, T target_pc)
 					if (target_pc == *next_pc) {
 						OR(EAX, TC_JMP_NEXT_PC << 4);
 						MOV(MEM32(RDX), EAX);
-						MOV(RDX, &m_cpu->tc->jmp_offset[1]);
-						MOV(RAX, MEM64(RDX));
-						gen_tail_call(RAX);
+						gen_tail_call_direct(1);
 					}
 					else {
 						OR(EAX, TC_JMP_RET << 4);
@@ -761,9 +1160,7 @@ void lc86_jit::link_direct_emit(addr_t dst_pc, addr_t *next_pc, T target_pc)
 					BR_NE(ret);
 					OR(EAX, TC_JMP_NEXT_PC << 4);
 					MOV(MEM32(RDX), EAX);
-					MOV(RDX, &m_cpu->tc->jmp_offset[1]);
-					MOV(RAX, MEM64(RDX));
-					gen_tail_call(RAX);
+					gen_tail_call_direct(1);
 					m_a.bind(ret);
 					OR(EAX, TC_JMP_RET << 4);
 					MOV(MEM32(RDX), EAX);
@@ -772,15 +1169,13 @@ void lc86_jit::link_direct_emit(addr_t dst_pc, addr_t *next_pc, T target_pc)
 			}
 		}
 		else { // uncond jmp dst_pc
-			MOV(RDX, &m_cpu->tc->jmp_offset[0]);
-			MOV(RAX, MEM64(RDX));
-			gen_tail_call(RAX);
+			gen_tail_call_direct(0);
 		}
 	}
 	break;
 
 	case 2: { // cond jmp next_pc + uncond jmp dst_pc
-		MOV(RDX, &m_cpu->tc->flags);
+		MOV_PTR(RDX, &m_cpu->tc->flags);
 		MOV(EBX, MEM32(RDX));
 		MOV(EAX, ~TC_FLG_JMP_TAKEN);
 		AND(EAX, EBX);
@@ -788,15 +1183,11 @@ void lc86_jit::link_direct_emit(addr_t dst_pc, addr_t *next_pc, T target_pc)
 			if (target_pc == *next_pc) {
 				OR(EAX, TC_JMP_NEXT_PC << 4);
 				MOV(MEM32(RDX), EAX);
-				MOV(RDX, &m_cpu->tc->jmp_offset[1]);
-				MOV(RAX, MEM64(RDX));
-				gen_tail_call(RAX);
+				gen_tail_call_direct(1);
 			}
 			else {
 				MOV(MEM32(RDX), EAX);
-				MOV(RDX, &m_cpu->tc->jmp_offset[0]);
-				MOV(RAX, MEM64(RDX));
-				gen_tail_call(RAX);
+				gen_tail_call_direct(0);
 			}
 		}
 		else {
@@ -805,14 +1196,10 @@ void lc86_jit::link_direct_emit(addr_t dst_pc, addr_t *next_pc, T target_pc)
 			BR_NE(ret);
 			OR(EAX, TC_JMP_NEXT_PC << 4);
 			MOV(MEM32(RDX), EAX);
-			MOV(RDX, &m_cpu->tc->jmp_offset[1]);
-			MOV(RAX, MEM64(RDX));
-			gen_tail_call(RAX);
+			gen_tail_call_direct(1);
 			m_a.bind(ret);
 			MOV(MEM32(RDX), EAX);
-			MOV(RDX, &m_cpu->tc->jmp_offset[0]);
-			MOV(RAX, MEM64(RDX));
-			gen_tail_call(RAX);
+			gen_tail_call_direct(0);
 		}
 	}
 	break;
@@ -842,13 +1229,11 @@ lc86_jit::link_dst_only_emit()
 
 	m_cpu->tc->flags |= (1 & TC_FLG_NUM_JMP);
 
-	MOV(RDX, &m_cpu->tc->jmp_offset[0]);
-	MOV(RAX, MEM64(RDX));
-	gen_tail_call(RAX);
+	gen_tail_call_direct(0);
 }
 
-void
-lc86_jit::link_indirect_emit()
+template<bool use_rsb>
+void lc86_jit::link_indirect_emit()
 {
 	m_needs_epilogue = false;
 
@@ -865,19 +1250,129 @@ lc86_jit::link_indirect_emit()
 	// make sure we check for interrupts before jumping to the next tc
 	check_int_emit();
 
-	MOV(RDX, m_cpu->tc);
-	MOV(RAX, &link_indirect_handler);
-	CALL(RAX);
+	// Probe the rsb (near rets only) and then the inline ibtc, and only call link_indirect_handler if both miss. Like in the handler, a tc can only be linked to
+	// another tc in the same page, so jumps to other pages can exit right away. The rsb is probed before that check, because a ret usually goes to the page of
+	// the caller. Its entries are only pushed for the tc's in the page of their call and it's emptied by tlb_flush, so they are still mapped like when they
+	// were pushed, see rsb_push_emit
+	Label miss = m_a.newLabel(), exit = m_a.newLabel();
+	MOV(EAX, MEMD32(RCX, CPU_CTX_EIP));
+	ADD(EAX, MEMD32(RCX, CPU_CTX_CS_BASE));
+	MOV(R8D, MEMD32(RCX, CPU_CTX_CS_BASE));
+	MOV(R9D, MEMD32(RCX, CPU_CTX_HFLG));
+	AND(R9D, HFLG_CONST);
+	MOV(R10D, MEMD32(RCX, CPU_CTX_EFLAGS));
+	AND(R10D, EFLAGS_CONST);
+	OR(R9D, R10D);
+	if constexpr (use_rsb) {
+		// always pop the rsb, so that it stays in sync with the guest calls even when it misses
+		Label rsb_miss = m_a.newLabel();
+		MOV(EDX, MEMD32(RCX, CPU_CTX_RSB_TOP));
+		LEA(R10D, MEMD32(RDX, -1));
+		AND(R10D, RSB_MAX_SIZE - 1);
+		MOV(MEMD32(RCX, CPU_CTX_RSB_TOP), R10D);
+		LEA(EDX, MEMS32(RDX, RDX, 1));
+		CMP(EAX, MEMSD32(RCX, RDX, 3, CPU_CTX_RSB_PC));
+		BR_NE(rsb_miss);
+		CMP(R8D, MEMSD32(RCX, RDX, 3, CPU_CTX_RSB_CS_BASE));
+		BR_NE(rsb_miss);
+		CMP(R9D, MEMSD32(RCX, RDX, 3, CPU_CTX_RSB_FLAGS));
+		BR_NE(rsb_miss);
+		MOV(RAX, MEMSD64(RCX, RDX, 3, CPU_CTX_RSB_CODE));
+		gen_tail_call(RAX);
+		m_a.bind(rsb_miss);
+	}
+	MOV(EDX, EAX);
+	AND(EDX, ~PAGE_MASK);
+	CMP(EDX, m_cpu->tc->virt_pc & ~PAGE_MASK);
+	BR_NE(exit);
+	MOV(EDX, EAX);
+	AND(EDX, IBTC_MAX_SIZE - 1);
+	LEA(EDX, MEMS32(RDX, RDX, 1));
+	CMP(EAX, MEMSD32(RCX, RDX, 3, CPU_CTX_IBTC_PC));
+	BR_NE(miss);
+	CMP(R8D, MEMSD32(RCX, RDX, 3, CPU_CTX_IBTC_CS_BASE));
+	BR_NE(miss);
+	CMP(R9D, MEMSD32(RCX, RDX, 3, CPU_CTX_IBTC_FLAGS));
+	BR_NE(miss);
+	MOV(RAX, MEMSD64(RCX, RDX, 3, CPU_CTX_IBTC_CODE));
+	gen_tail_call(RAX);
+	m_a.bind(miss);
+	MOV_PTR(RDX, m_cpu->tc);
+	CALL_F(&link_indirect_handler);
 	RELOAD_RCX_CTX();
 	gen_tail_call(RAX);
+	m_a.bind(exit);
+	gen_epilogue_main();
 }
 
-void
-lc86_jit::link_ret_emit()
+template<bool use_rsb>
+void lc86_jit::link_ret_emit()
 {
-	// NOTE: perhaps find a way to use a return stack buffer to link to the next tc
+	// use_rsb should only be set by near rets, because only near calls push on the rsb
 
-	link_indirect_emit();
+	link_indirect_emit<use_rsb>();
+}
+
+void
+lc86_jit::rsb_push_emit(addr_t ret_pc)
+{
+	// Pushes on the rsb the tc at ret_pc, which is then validated by the matching ret in link_indirect_emit. The tc is copied from the ibtc when it's there,
+	// otherwise rsb_push_handler looks for it in the code cache. A ret_pc outside of the page of the tc is pushed as an empty entry, so that the rsb only
+	// has tc's whose physical page is known to be mapped when they are pushed. All volatile regs are clobbered
+
+	MOV(EDX, MEMD32(RCX, CPU_CTX_RSB_TOP));
+	ADD(EDX, 1);
+	AND(EDX, RSB_MAX_SIZE - 1);
+	MOV(MEMD32(RCX, CPU_CTX_RSB_TOP), EDX);
+	LEA(EDX, MEMS32(RDX, RDX, 1));
+	MOV(MEMSD32(RCX, RDX, 3, CPU_CTX_RSB_FLAGS), IBTC_INVALID_FLAGS);
+	if ((ret_pc ^ m_cpu->tc->virt_pc) & ~PAGE_MASK) {
+		return;
+	}
+
+	Label miss = m_a.newLabel(), done = m_a.newLabel();
+	size_t ibtc_off = (ret_pc & (IBTC_MAX_SIZE - 1)) * sizeof(ibtc_entry_t);
+	CMP(MEMD32(RCX, CPU_CTX_IBTC_PC + ibtc_off), ret_pc);
+	BR_NE(miss);
+	CMP(MEMD32(RCX, CPU_CTX_IBTC_CS_BASE + ibtc_off), m_cpu->tc->cs_base);
+	BR_NE(miss);
+	CMP(MEMD32(RCX, CPU_CTX_IBTC_FLAGS + ibtc_off), m_cpu->tc->cpu_flags);
+	BR_NE(miss);
+	for (size_t i = 0; i < sizeof(ibtc_entry_t); i += 8) {
+		MOV(RAX, MEMD64(RCX, CPU_CTX_IBTC_PC + ibtc_off + i));
+		MOV(MEMSD64(RCX, RDX, 3, CPU_CTX_RSB_PC + i), RAX);
+	}
+	BR_UNCOND(done);
+	m_a.bind(miss);
+	MOV_PTR(RDX, m_cpu->tc);
+	MOV(R8D, ret_pc);
+	CALL_F(&rsb_push_handler);
+	RELOAD_RCX_CTX();
+	m_a.bind(done);
+}
+
+bool
+lc86_jit::trace_follow_direct(addr_t dst_pc)
+{
+	// Decides if translation can continue at dst_pc in the current tc, instead of linking to another tc. Both the current instr and dst_pc must be in the page
+	// of the tc, because the tc is only invalidated by writes to that page, and dst_pc must not be hooked, because hooks are only taken at the start of a tc.
+	// The number of jumps followed is bounded, so that the interrupt check done when linking is not delayed for too long. Tier 0 tc's don't form traces
+
+	if ((m_cpu->cpu_flags & CPU_TRACE_BLOCKS) &&
+		!(m_cpu->tc->flags & TC_FLG_TIER0) &&
+		(m_cpu->trace_len < TRACE_MAX_JMP) &&
+		!(m_cpu->cpu_ctx.hflags & HFLG_DBG_TRAP) &&
+		(dst_pc != m_cpu->tc->virt_pc) &&
+		(((dst_pc ^ m_cpu->tc->virt_pc) & ~PAGE_MASK) == 0) &&
+		((((m_cpu->virt_pc + m_cpu->instr_bytes - 1) ^ m_cpu->tc->virt_pc) & ~PAGE_MASK) == 0) &&
+		(m_cpu->hook_map.find(dst_pc) == m_cpu->hook_map.end())) {
+		m_cpu->trace_len++;
+		m_cpu->trace_next = 1;
+		m_cpu->trace_pc = dst_pc;
+		return true;
+	}
+
+	return false;
 }
 
 template<bool add_seg_base>
@@ -1499,6 +1994,11 @@ void lc86_jit::gen_sub_vec32(T b)
 template<typename T>
 void lc86_jit::set_flags_sum(x86::Gp a, T b, x86::Gp sum)
 {
+	if (m_cpu->instr_flags_dead) {
+		// the flags are overwritten by a later instr before they can be read, see cpu_flags_liveness
+		return;
+	}
+
 	// a: reg, b: e(d|b)x/(d|b)x/(d|b)l or imm32/16/8, sum: r8d/w/b
 
 	assert(sum.id() == x86::Gp::kIdR8);
@@ -1539,6 +2039,11 @@ void lc86_jit::set_flags_sum(x86::Gp a, T b, x86::Gp sum)
 template<typename T1, typename T2>
 void lc86_jit::set_flags_sub(T1 a, T2 b, x86::Gp sub)
 {
+	if (m_cpu->instr_flags_dead) {
+		// the flags are overwritten by a later instr before they can be read, see cpu_flags_liveness
+		return;
+	}
+
 	// a: reg or imm32/16/8, b: e(d|b)x/(d|b)x/(d|b)l or imm32/16/8, sub: r8d/w/b
 
 	assert(sub.id() == x86::Gp::kIdR8);
@@ -1579,6 +2084,10 @@ void lc86_jit::set_flags_sub(T1 a, T2 b, x86::Gp sub)
 template<typename T1, typename T2>
 void lc86_jit::set_flags(T1 res, T2 aux, size_t res_size)
 {
+	if (m_cpu->instr_flags_dead) {
+		return;
+	}
+
 	if (res_size != SIZE32) {
 		if constexpr (std::is_integral_v<T1>) {
 			int32_t res1 = static_cast<int32_t>(res);
@@ -1624,9 +2133,252 @@ lc86_jit::ld_pf(x86::Gp dst, x86::Gp res, x86::Gp aux)
 	MOVZX(dst, MEMS8(dst.r64(), res.r64(), 0));
 }
 
+void
+lc86_jit::reg_alloc_reset()
+{
+	std::fill(std::begin(m_ra_slot), std::end(m_ra_slot), -1);
+	std::fill(std::begin(m_ra_guest), std::end(m_ra_guest), -1);
+	std::fill(std::begin(m_ra_age), std::end(m_ra_age), 0);
+	m_ra_clock = 0;
+	m_ra_dirty = 0;
+}
+
+void
+lc86_jit::reg_alloc_writeback_emit()
+{
+	// RCX: cpu_ctx. This doesn't change the allocation state, so it can be used in any code path of an instr (e.g. before calling a helper)
+
+	for (unsigned guest_idx = 0; guest_idx < RA_NUM_GUEST_REGS; ++guest_idx) {
+		if (m_ra_dirty & (1 << guest_idx)) {
+			MOV(MEMD32(RCX, CPU_CTX_EAX + guest_idx * 4), ra_host_regs[m_ra_slot[guest_idx]].r32());
+		}
+	}
+}
+
+void
+lc86_jit::reg_alloc_flush_emit()
+{
+	// This must only be used between instrs, since it changes the allocation state
+	reg_alloc_writeback_emit();
+	reg_alloc_reset();
+}
+
+int
+lc86_jit::reg_alloc_get_slot(size_t reg_offset)
+{
+	if ((reg_offset < CPU_CTX_EAX) || (reg_offset >= (CPU_CTX_EDI + 4))) {
+		return -1;
+	}
+
+	int slot = m_ra_slot[(reg_offset - CPU_CTX_EAX) >> 2];
+	if ((slot != -1) && ((reg_offset - CPU_CTX_EAX) & 3)) {
+		// reg_alloc_is_supported rejects instrs that use ah, ch, dh and bh, so this should never happen
+		LIB86CPU_ABORT_msg("Attempted to access the high byte of a cached guest register");
+	}
+
+	return slot;
+}
+
+bool
+lc86_jit::reg_alloc_is_supported(ZydisDecodedInstruction *instr)
+{
+	// Only instrs whose emitters access the guest gprs exclusively with load/store_reg, and only call the memory helpers or raise exceptions, can use
+	// the cached guest regs. Everything else sees the guest regs in the cpu_ctx
+
+	switch (instr->mnemonic)
+	{
+	case ZYDIS_MNEMONIC_CALL:
+	case ZYDIS_MNEMONIC_JMP:
+		// far call and jmp use helpers that read the guest regs
+		if ((instr->opcode == 0x9A) || (instr->opcode == 0xEA) || ((instr->opcode == 0xFF) && ((instr->raw.modrm.reg & 1) == 1))) {
+			return false;
+		}
+		break;
+
+	case ZYDIS_MNEMONIC_ADC:
+	case ZYDIS_MNEMONIC_ADD:
+	case ZYDIS_MNEMONIC_AND:
+	case ZYDIS_MNEMONIC_CMP:
+	case ZYDIS_MNEMONIC_DEC:
+	case ZYDIS_MNEMONIC_IMUL:
+	case ZYDIS_MNEMONIC_INC:
+	case ZYDIS_MNEMONIC_JB:
+	case ZYDIS_MNEMONIC_JBE:
+	case ZYDIS_MNEMONIC_JL:
+	case ZYDIS_MNEMONIC_JLE:
+	case ZYDIS_MNEMONIC_JNB:
+	case ZYDIS_MNEMONIC_JNBE:
+	case ZYDIS_MNEMONIC_JNL:
+	case ZYDIS_MNEMONIC_JNLE:
+	case ZYDIS_MNEMONIC_JNO:
+	case ZYDIS_MNEMONIC_JNP:
+	case ZYDIS_MNEMONIC_JNS:
+	case ZYDIS_MNEMONIC_JNZ:
+	case ZYDIS_MNEMONIC_JO:
+	case ZYDIS_MNEMONIC_JP:
+	case ZYDIS_MNEMONIC_JS:
+	case ZYDIS_MNEMONIC_JZ:
+	case ZYDIS_MNEMONIC_LEA:
+	case ZYDIS_MNEMONIC_MOV:
+	case ZYDIS_MNEMONIC_MOVSX:
+	case ZYDIS_MNEMONIC_MOVZX:
+	case ZYDIS_MNEMONIC_NEG:
+	case ZYDIS_MNEMONIC_NOP:
+	case ZYDIS_MNEMONIC_NOT:
+	case ZYDIS_MNEMONIC_OR:
+	case ZYDIS_MNEMONIC_POP:
+	case ZYDIS_MNEMONIC_PUSH:
+	case ZYDIS_MNEMONIC_SAR:
+	case ZYDIS_MNEMONIC_SBB:
+	case ZYDIS_MNEMONIC_SHL:
+	case ZYDIS_MNEMONIC_SHR:
+	case ZYDIS_MNEMONIC_SUB:
+	case ZYDIS_MNEMONIC_TEST:
+	case ZYDIS_MNEMONIC_XCHG:
+	case ZYDIS_MNEMONIC_XOR:
+		break;
+
+	default:
+		return false;
+	}
+
+	// this rejects mov/push/pop of segment, control and debug regs, and the high byte regs, which cannot be cached
+	for (unsigned i = 0; i < instr->operand_count; ++i) {
+		const ZydisDecodedOperand *operand = &instr->operands[i];
+		switch (operand->type)
+		{
+		case ZYDIS_OPERAND_TYPE_REGISTER:
+			switch (ZydisRegisterGetClass(operand->reg.value))
+			{
+			case ZYDIS_REGCLASS_GPR8:
+				if ((operand->reg.value == ZYDIS_REGISTER_AH) || (operand->reg.value == ZYDIS_REGISTER_CH) ||
+					(operand->reg.value == ZYDIS_REGISTER_DH) || (operand->reg.value == ZYDIS_REGISTER_BH)) {
+					return false;
+				}
+				break;
+
+			case ZYDIS_REGCLASS_GPR16:
+			case ZYDIS_REGCLASS_GPR32:
+			case ZYDIS_REGCLASS_FLAGS:
+			case ZYDIS_REGCLASS_IP:
+				break;
+
+			default:
+				return false;
+			}
+			break;
+
+		case ZYDIS_OPERAND_TYPE_MEMORY:
+		case ZYDIS_OPERAND_TYPE_IMMEDIATE:
+			break;
+
+		default:
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void
+lc86_jit::reg_alloc_instr(ZydisDecodedInstruction *instr)
+{
+	// Block-local register allocation: the guest gprs used by an instr are loaded in a host callee-saved reg right before the instr, and then stay there
+	// until the end of the tc. Modified regs are written back to the cpu_ctx only when the tc exits, before calling helpers that can observe them (memory
+	// helpers and exceptions) and before instrs that are not supported by the allocator. Loads, evictions and flushes are only emitted between instrs, so
+	// the allocation state is the same in all the code paths of the emitted instr. Tier 0 tc's don't cache the guest regs, to keep them fast to translate
+
+	if ((m_cpu->tc->flags & TC_FLG_TIER0) || !reg_alloc_is_supported(instr)) {
+		reg_alloc_flush_emit();
+		return;
+	}
+
+	uint8_t used = 0;
+	auto add_gpr = [&used](ZydisRegister reg) {
+		switch (ZydisRegisterGetClass(reg))
+		{
+		case ZYDIS_REGCLASS_GPR8:
+		case ZYDIS_REGCLASS_GPR16:
+		case ZYDIS_REGCLASS_GPR32:
+			used |= (1 << ZydisRegisterGetId(reg));
+			break;
+
+		default:
+			break;
+		}
+	};
+
+	for (unsigned i = 0; i < instr->operand_count; ++i) {
+		const ZydisDecodedOperand *operand = &instr->operands[i];
+		if (operand->type == ZYDIS_OPERAND_TYPE_REGISTER) {
+			add_gpr(operand->reg.value);
+		}
+		else if (operand->type == ZYDIS_OPERAND_TYPE_MEMORY) {
+			add_gpr(operand->mem.base);
+			add_gpr(operand->mem.index);
+		}
+	}
+
+	++m_ra_clock;
+	for (unsigned guest_idx = 0; guest_idx < RA_NUM_GUEST_REGS; ++guest_idx) {
+		if ((used & (1 << guest_idx)) == 0) {
+			continue;
+		}
+
+		int slot = m_ra_slot[guest_idx];
+		if (slot == -1) {
+			// find a free host reg, or else evict the least recently used one that is not needed by this instr
+			for (int i = 0; i < RA_NUM_HOST_REGS; ++i) {
+				if (m_ra_guest[i] == -1) {
+					slot = i;
+					break;
+				}
+				if ((used & (1 << m_ra_guest[i])) == 0 && ((slot == -1) || (m_ra_age[i] < m_ra_age[slot]))) {
+					slot = i;
+				}
+			}
+			assert(slot != -1);
+
+			if (int evicted_idx = m_ra_guest[slot]; evicted_idx != -1) {
+				if (m_ra_dirty & (1 << evicted_idx)) {
+					MOV(MEMD32(RCX, CPU_CTX_EAX + evicted_idx * 4), ra_host_regs[slot].r32());
+					m_ra_dirty &= ~(1 << evicted_idx);
+				}
+				m_ra_slot[evicted_idx] = -1;
+			}
+
+			MOV(ra_host_regs[slot].r32(), MEMD32(RCX, CPU_CTX_EAX + guest_idx * 4));
+			m_ra_slot[guest_idx] = slot;
+			m_ra_guest[slot] = guest_idx;
+		}
+		m_ra_age[slot] = m_ra_clock;
+	}
+}
+
 void
 lc86_jit::load_reg(x86::Gp dst, size_t reg_offset, size_t size)
 {
+	if (int slot = reg_alloc_get_slot(reg_offset); slot != -1) {
+		switch (size)
+		{
+		case SIZE8:
+			MOV(dst, ra_host_regs[slot].r8());
+			break;
+
+		case SIZE16:
+			MOV(dst, ra_host_regs[slot].r16());
+			break;
+
+		case SIZE32:
+			MOV(dst, ra_host_regs[slot].r32());
+			break;
+
+		default:
+			LIB86CPU_ABORT();
+		}
+		return;
+	}
+
 	switch (size)
 	{
 	case SIZE8:
@@ -1649,6 +2401,28 @@ lc86_jit::load_reg(x86::Gp dst, size_t reg_offset, size_t size)
 template<typename T>
 void lc86_jit::store_reg(T val, size_t reg_offset, size_t size)
 {
+	if (int slot = reg_alloc_get_slot(reg_offset); slot != -1) {
+		switch (size)
+		{
+		case SIZE8:
+			MOV(ra_host_regs[slot].r8(), val);
+			break;
+
+		case SIZE16:
+			MOV(ra_host_regs[slot].r16(), val);
+			break;
+
+		case SIZE32:
+			MOV(ra_host_regs[slot].r32(), val);
+			break;
+
+		default:
+			LIB86CPU_ABORT();
+		}
+		m_ra_dirty |= (1 << ((reg_offset - CPU_CTX_EAX) >> 2));
+		return;
+	}
+
 	switch (size)
 	{
 	case SIZE8:
@@ -1668,34 +2442,156 @@ void lc86_jit::store_reg(T val, size_t reg_offset, size_t size)
 	}
 }
 
+template<bool is_write>
+void lc86_jit::tlb_lookup_emit(Label slow, uint8_t size, uint8_t is_priv, Label code_page)
+{
+	// RCX: cpu_ctx, EDX: addr; on a hit, RAX holds the host address of the access, otherwise jumps to slow. Only RAX and R9 are clobbered
+	// This is the inline version of the tlb check done in mem_read/write_helper, and only ram pages, and rom pages for reads, are handled here. The cpl is part
+	// of the tc flags, so the access mask can be calculated now instead of at runtime. Writes that miss jump to code_page instead, see tlb_lookup_code_emit
+
+	uint32_t mem_access = tlb_access[is_write][(m_cpu->cpu_ctx.hflags & HFLG_CPL) >> is_priv];
+	uint32_t tlb_mask = mem_access | TLB_WATCH | TLB_RAM | TLB_ROM | TLB_MMIO | TLB_SUBPAGE;
+	if constexpr (is_write) {
+		// writes must also miss when the page has translated code or the dirty flag is not set yet. The former are checked again by tlb_lookup_code_emit
+		mem_access |= TLB_DIRTY;
+		tlb_mask |= (TLB_DIRTY | TLB_CODE);
+	}
+
+#ifdef LIB86CPU_COMPACT_TLB
+	// the page must also be the one cached by its slot of the compact tlb
+	MOV(EAX, EDX);
+	SHR(EAX, PAGE_SHIFT);
+	AND(EAX, TLB_NUM_SLOTS - 1);
+	MOV(R9D, EDX);
+	AND(R9D, ~PAGE_MASK);
+	CMP(R9D, MEMSD32(RCX, RAX, 3, CPU_CTX_TLB + offsetof(tlb_slot_t, tag)));
+	BR_NE(slow);
+	MOV(EAX, MEMSD32(RCX, RAX, 3, CPU_CTX_TLB + offsetof(tlb_slot_t, entry)));
+#else
+	MOV(EAX, EDX);
+	SHR(EAX, PAGE_SHIFT);
+	MOV(EAX, MEMSD32(RCX, RAX, 2, CPU_CTX_TLB));
+#endif
+	if (size != SIZE8) {
+		// accesses that cross pages always use the helper
+		MOV(R9D, EDX);
+		AND(R9D, PAGE_MASK);
+		CMP(R9D, PAGE_SIZE - (1 << size));
+		BR_UGT(slow);
+	}
+	MOV(R9D, EAX);
+	AND(R9D, tlb_mask);
+	CMP(R9D, mem_access | TLB_RAM);
+	if constexpr (is_write) {
+		BR_NE(code_page);
+	}
+	else {
+		Label hit = m_a.newLabel();
+		BR_EQ(hit);
+		CMP(R9D, mem_access | TLB_ROM);
+		BR_NE(slow);
+		m_a.bind(hit);
+	}
+	tlb_host_addr_emit();
+}
+
+void
+lc86_jit::tlb_lookup_code_emit(Label slow, uint8_t is_priv)
+{
+	// RCX: cpu_ctx, EDX: addr, EAX: tlb entry, R9D: tlb entry masked by tlb_lookup_emit<true>; on a hit, RAX holds the host address of the write, otherwise
+	// jumps to slow. This handles the writes to ram pages with translated code, which don't need to invalidate anything when they don't touch the granules
+	// of the page that hold the code. Only the granule of the first byte is checked, because tc_smc_page_mask already extends the code backwards by enough
+	// bytes for the biggest write done by store_mem. Pages with TLB_RAM are always in ram, so their index in smc is never out of bounds
+
+	static_assert((1 << SIZE32) <= SMC_MAX_WRITE_SIZE, "store_mem writes more bytes than tc_smc_page_mask covers");
+	uint32_t mem_access = tlb_access[1][(m_cpu->cpu_ctx.hflags & HFLG_CPL) >> is_priv] | TLB_DIRTY;
+	CMP(R9D, mem_access | TLB_RAM | TLB_CODE);
+	BR_NE(slow);
+	MOV(R9D, EAX);
+	SHR(R9D, PAGE_SHIFT);
+	SUB(R9D, MEMD32(RCX, CPU_CTX_SMC_PAGE));
+	MOV(RAX, MEMD64(RCX, CPU_CTX_SMC));
+	MOV(R9, MEMSD64(RAX, R9, 3, 0));
+	MOV(EAX, EDX);
+	SHR(EAX, SMC_GRANULE_SHIFT);
+	BT(R9, RAX); // the bit offset is taken modulo 64, which gives the granule of addr in the page
+	BR_ULT(slow); // taken if CF is set
+	tlb_host_addr_emit();
+}
+
+void
+lc86_jit::tlb_host_addr_emit()
+{
+	// RCX: cpu_ctx, EDX: addr of a ram or rom page in the tlb; RAX holds the host address of addr, which is the host addend of the page plus addr.
+	// Only RAX and R9 are clobbered
+
+	MOV(EAX, EDX);
+	SHR(EAX, PAGE_SHIFT);
+#ifdef LIB86CPU_COMPACT_TLB
+	AND(EAX, TLB_NUM_SLOTS - 1);
+#endif
+	MOV(RAX, MEMSD64(RCX, RAX, 3, CPU_CTX_TLB_ADDEND));
+	MOV(R9D, EDX);
+	ADD(RAX, R9);
+}
+
 void
 lc86_jit::load_mem(uint8_t size, uint8_t is_priv)
 {
 	// RCX: cpu_ctx, EDX: addr, R8: instr_eip, R9B: is_priv
 
+	Label slow = m_a.newLabel(), done = m_a.newLabel();
+	if (!(m_cpu->tc->flags & TC_FLG_TIER0)) {
+		// tier 0 tc's always use the helper, so that they are smaller and faster to emit
+		tlb_lookup_emit<false>(slow, size, is_priv);
+
+		switch (size)
+		{
+		case SIZE32:
+			MOV(EAX, MEMD32(RAX, 0));
+			break;
+
+		case SIZE16:
+			MOVZX(EAX, MEMD16(RAX, 0));
+			break;
+
+		case SIZE8:
+			MOVZX(EAX, MEMD8(RAX, 0));
+			break;
+
+		default:
+			LIB86CPU_ABORT();
+		}
+
+		BR_UNCOND(done);
+	}
+	m_a.bind(slow);
+	reg_alloc_writeback_emit();
 	MOV(R9B, is_priv);
 	MOV(R8D, m_cpu->instr_eip);
 
+	const void *helper_fn = nullptr;
 	switch (size)
 	{
 	case SIZE32:
-		MOV(RAX, &mem_read_helper<uint32_t>);
+		helper_fn = reinterpret_cast<const void *>(&mem_read_helper<uint32_t>);
 		break;
 
 	case SIZE16:
-		MOV(RAX, &mem_read_helper<uint16_t>);
+		helper_fn = reinterpret_cast<const void *>(&mem_read_helper<uint16_t>);
 		break;
 
 	case SIZE8:
-		MOV(RAX, &mem_read_helper<uint8_t>);
+		helper_fn = reinterpret_cast<const void *>(&mem_read_helper<uint8_t>);
 		break;
 
 	default:
 		LIB86CPU_ABORT();
 	}
 
-	CALL(RAX);
+	CALL_F(helper_fn);
 	RELOAD_RCX_CTX();
+	m_a.bind(done);
 }
 
 template<typename T>
@@ -1703,32 +2599,104 @@ void lc86_jit::store_mem(T val, uint8_t size, uint8_t is_priv)
 {
 	// RCX: cpu_ctx, EDX: addr, R8B/R8W/R8D: val, R9D: instr_eip, stack: is_priv
 
+	Label slow = m_a.newLabel(), done = m_a.newLabel(), code_page = m_a.newLabel();
+
+	if (m_cpu->tc->flags & TC_FLG_TIER0) {
+		// tier 0 tc's always use the helper, so that they are smaller and faster to emit
+		switch (size)
+		{
+		case SIZE32:
+			MOV(R8D, val);
+			break;
+
+		case SIZE16:
+			MOV(R8W, val);
+			break;
+
+		case SIZE8:
+			MOV(R8B, val);
+			break;
+
+		default:
+			LIB86CPU_ABORT();
+		}
+	}
+	else {
+		switch (size)
+		{
+		case SIZE32:
+			MOV(R8D, val);
+			tlb_lookup_emit<true>(slow, size, is_priv, code_page);
+			MOV(MEMD32(RAX, 0), R8D);
+			break;
+
+		case SIZE16:
+			MOV(R8W, val);
+			tlb_lookup_emit<true>(slow, size, is_priv, code_page);
+			MOV(MEMD16(RAX, 0), R8W);
+			break;
+
+		case SIZE8:
+			MOV(R8B, val);
+			tlb_lookup_emit<true>(slow, size, is_priv, code_page);
+			MOV(MEMD8(RAX, 0), R8B);
+			break;
+
+		default:
+			LIB86CPU_ABORT();
+		}
+
+		BR_UNCOND(done);
+		m_a.bind(code_page);
+		tlb_lookup_code_emit(slow, is_priv);
+
+		switch (size)
+		{
+		case SIZE32:
+			MOV(MEMD32(RAX, 0), R8D);
+			break;
+
+		case SIZE16:
+			MOV(MEMD16(RAX, 0), R8W);
+			break;
+
+		case SIZE8:
+			MOV(MEMD8(RAX, 0), R8B);
+			break;
+
+		default:
+			LIB86CPU_ABORT();
+		}
+
+		BR_UNCOND(done);
+	}
+	m_a.bind(slow);
+	reg_alloc_writeback_emit();
 	MOV(MEMD32(RSP, STACK_ARGS_off), is_priv);
 	MOV(R9D, m_cpu->instr_eip);
 
+	const void *helper_fn = nullptr;
 	switch (size)
 	{
 	case SIZE32:
-		MOV(R8D, val);
-		MOV(RAX, &mem_write_helper<uint32_t>);
+		helper_fn = reinterpret_cast<const void *>(&mem_write_helper<uint32_t>);
 		break;
 
 	case SIZE16:
-		MOV(R8W, val);
-		MOV(RAX, &mem_write_helper<uint16_t>);
+		helper_fn = reinterpret_cast<const void *>(&mem_write_helper<uint16_t>);
 		break;
 
 	case SIZE8:
-		MOV(R8B, val);
-		MOV(RAX, &mem_write_helper<uint8_t>);
+		helper_fn = reinterpret_cast<const void *>(&mem_write_helper<uint8_t>);
 		break;
 
 	default:
 		LIB86CPU_ABORT();
 	}
 
-	CALL(RAX);
+	CALL_F(helper_fn);
 	RELOAD_RCX_CTX();
+	m_a.bind(done);
 }
 
 void
@@ -1736,25 +2704,26 @@ lc86_jit::load_io(uint8_t size_mode)
 {
 	// RCX: cpu_ctx, EDX: port
 
+	const void *helper_fn = nullptr;
 	switch (size_mode)
 	{
 	case SIZE32:
-		MOV(RAX, &io_read_helper<uint32_t>);
+		helper_fn = reinterpret_cast<const void *>(&io_read_helper<uint32_t>);
 		break;
 
 	case SIZE16:
-		MOV(RAX, &io_read_helper<uint16_t>);
+		helper_fn = reinterpret_cast<const void *>(&io_read_helper<uint16_t>);
 		break;
 
 	case SIZE8:
-		MOV(RAX, &io_read_helper<uint8_t>);
+		helper_fn = reinterpret_cast<const void *>(&io_read_helper<uint8_t>);
 		break;
 
 	default:
 		LIB86CPU_ABORT();
 	}
 
-	CALL(RAX);
+	CALL_F(helper_fn);
 	RELOAD_RCX_CTX();
 }
 
@@ -1764,28 +2733,29 @@ lc86_jit::store_io(uint8_t size_mode)
 	// RCX: cpu_ctx, EDX: port, R8B/R8W/R8D: val
 	// register val, should have been placed in EAX/AX/AL by load_reg or something else
 
+	const void *helper_fn = nullptr;
 	switch (size_mode)
 	{
 	case SIZE32:
 		MOV(R8D, EAX);
-		MOV(RAX, &io_write_helper<uint32_t>);
+		helper_fn = reinterpret_cast<const void *>(&io_write_helper<uint32_t>);
 		break;
 
 	case SIZE16:
 		MOV(R8W, AX);
-		MOV(RAX, &io_write_helper<uint16_t>);
+		helper_fn = reinterpret_cast<const void *>(&io_write_helper<uint16_t>);
 		break;
 
 	case SIZE8:
 		MOV(R8B, AL);
-		MOV(RAX, &io_write_helper<uint8_t>);
+		helper_fn = reinterpret_cast<const void *>(&io_write_helper<uint8_t>);
 		break;
 
 	default:
 		LIB86CPU_ABORT();
 	}
 
-	CALL(RAX);
+	CALL_F(helper_fn);
 	RELOAD_RCX_CTX();
 }
 
@@ -2688,8 +3658,7 @@ void lc86_jit::load_sys_seg_reg(ZydisDecodedInstruction *instr)
 
 				if (m_cpu->cpu_flags & CPU_DBG_PRESENT) {
 					// hook the breakpoint exception handler so that the debugger can catch it
-					MOV(RAX, &dbg_update_exp_hook);
-					CALL(RAX);
+					CALL_F(&dbg_update_exp_hook);
 					RELOAD_RCX_CTX();
 				}
 			}
@@ -2713,12 +3682,11 @@ void lc86_jit::load_sys_seg_reg(ZydisDecodedInstruction *instr)
 			MOV(R8D, m_cpu->instr_eip);
 			MOV(DX, AX);
 			if constexpr (idx == LDTR_idx) {
-				MOV(RAX, &lldt_helper);
+				CALL_F(&lldt_helper);
 			}
 			else {
-				MOV(RAX, &ltr_helper);
+				CALL_F(&ltr_helper);
 			}
-			CALL(RAX);
 			RELOAD_RCX_CTX();
 			CMP(AL, 0);
 			BR_EQ(ok);
@@ -2746,12 +3714,11 @@ void lc86_jit::verx(ZydisDecodedInstruction *instr)
 	MOV(R8D, m_cpu->instr_eip);
 	MOV(DX, AX);
 	if constexpr (is_verr) {
-		MOV(RAX, &verrw_helper<true>);
+		CALL_F(&verrw_helper<true>);
 	}
 	else {
-		MOV(RAX, &verrw_helper<false>);
+		CALL_F(&verrw_helper<false>);
 	}
-	CALL(RAX);
 	RELOAD_RCX_CTX();
 }
 
@@ -2780,26 +3747,27 @@ void lc86_jit::lxs(ZydisDecodedInstruction *instr)
 		MOV(R8D, m_cpu->instr_eip);
 		MOV(DX, AX);
 
+		const void *helper_fn = nullptr;
 		switch (idx)
 		{
 		case SS_idx:
-			MOV(RAX, &mov_sel_pe_helper<SS_idx>);
+			helper_fn = reinterpret_cast<const void *>(&mov_sel_pe_helper<SS_idx>);
 			break;
 
 		case FS_idx:
-			MOV(RAX, &mov_sel_pe_helper<FS_idx>);
+			helper_fn = reinterpret_cast<const void *>(&mov_sel_pe_helper<FS_idx>);
 			break;
 
 		case GS_idx:
-			MOV(RAX, &mov_sel_pe_helper<GS_idx>);
+			helper_fn = reinterpret_cast<const void *>(&mov_sel_pe_helper<GS_idx>);
 			break;
 
 		case ES_idx:
-			MOV(RAX, &mov_sel_pe_helper<ES_idx>);
+			helper_fn = reinterpret_cast<const void *>(&mov_sel_pe_helper<ES_idx>);
 			break;
 
 		case DS_idx:
-			MOV(RAX, &mov_sel_pe_helper<DS_idx>);
+			helper_fn = reinterpret_cast<const void *>(&mov_sel_pe_helper<DS_idx>);
 			break;
 
 		default:
@@ -2807,7 +3775,7 @@ void lc86_jit::lxs(ZydisDecodedInstruction *instr)
 		}
 
 		Label ok = m_a.newLabel();
-		CALL(RAX);
+		CALL_F(helper_fn);
 		RELOAD_RCX_CTX();
 		CMP(AL, 0);
 		BR_EQ(ok);
@@ -3510,8 +4478,7 @@ lc86_jit::call(ZydisDecodedInstruction *instr)
 			MOV(R9B, m_cpu->size_mode);
 			MOV(R8D, call_eip);
 			MOV(EDX, new_sel);
-			MOV(RAX, &lcall_pe_helper);
-			CALL(RAX);
+			CALL_F(&lcall_pe_helper);
 			RELOAD_RCX_CTX();
 			CMP(AL, 0);
 			BR_NE(exp);
@@ -3541,6 +4508,10 @@ lc86_jit::call(ZydisDecodedInstruction *instr)
 		addr_t call_pc = m_cpu->cpu_ctx.regs.cs_hidden.base + call_eip;
 
 		stack_push_emit(ret_eip);
+		rsb_push_emit(m_cpu->cpu_ctx.regs.cs_hidden.base + ret_eip);
+		if (trace_follow_direct(call_pc)) {
+			return;
+		}
 		ST_R32(CPU_CTX_EIP, call_eip);
 		link_direct_emit(call_pc, nullptr, call_pc);
 		m_cpu->tc->flags |= TC_FLG_DIRECT;
@@ -3562,6 +4533,7 @@ lc86_jit::call(ZydisDecodedInstruction *instr)
 				});
 			MOV(MEMD32(RSP, LOCAL_VARS_off(0)), EAX);
 			stack_push_emit(ret_eip);
+			rsb_push_emit(m_cpu->cpu_ctx.regs.cs_hidden.base + ret_eip);
 			MOV(EAX, MEMD16(RSP, LOCAL_VARS_off(0)));
 			if (m_cpu->size_mode == SIZE16) {
 				MOVZX(EAX, AX);
@@ -3595,8 +4567,7 @@ lc86_jit::call(ZydisDecodedInstruction *instr)
 				MOV(R9B, m_cpu->size_mode);
 				MOV(R8D, EBX);
 				MOV(EDX, EAX);
-				MOV(RAX, &lcall_pe_helper);
-				CALL(RAX);
+				CALL_F(&lcall_pe_helper);
 				RELOAD_RCX_CTX();
 				CMP(AL, 0);
 				BR_NE(exp);
@@ -4068,8 +5039,7 @@ lc86_jit::cmps(ZydisDecodedInstruction *instr)
 void
 lc86_jit::cpuid(ZydisDecodedInstruction *instr)
 {
-	MOV(RAX, &cpuid_helper);
-	CALL(RAX);
+	CALL_F(&cpuid_helper);
 	RELOAD_RCX_CTX();
 }
 
@@ -4281,6 +5251,7 @@ lc86_jit::div(ZydisDecodedInstruction *instr)
 	case 0xF7: {
 		assert(instr->raw.modrm.reg == 6);
 
+		const void *helper_fn = nullptr;
 		switch (m_cpu->size_mode)
 		{
 		case SIZE8:
@@ -4294,7 +5265,7 @@ lc86_jit::div(ZydisDecodedInstruction *instr)
 					LD_MEM();
 					MOV(DL, AL);
 				});
-			MOV(RAX, &divb_helper);
+			helper_fn = reinterpret_cast<const void *>(&divb_helper);
 			break;
 
 		case SIZE16:
@@ -4308,7 +5279,7 @@ lc86_jit::div(ZydisDecodedInstruction *instr)
 					LD_MEM();
 					MOV(DX, AX);
 				});
-			MOV(RAX, &divw_helper);
+			helper_fn = reinterpret_cast<const void *>(&divw_helper);
 			break;
 
 		case SIZE32:
@@ -4322,7 +5293,7 @@ lc86_jit::div(ZydisDecodedInstruction *instr)
 					LD_MEM();
 					MOV(EDX, EAX);
 				});
-			MOV(RAX, &divd_helper);
+			helper_fn = reinterpret_cast<const void *>(&divd_helper);
 			break;
 
 		default:
@@ -4331,7 +5302,7 @@ lc86_jit::div(ZydisDecodedInstruction *instr)
 
 		Label ok = m_a.newLabel();
 		MOV(R8D, m_cpu->instr_eip);
-		CALL(RAX);
+		CALL_F(helper_fn);
 		RELOAD_RCX_CTX();
 		CMP(AL, 0);
 		BR_EQ(ok);
@@ -4369,6 +5340,7 @@ lc86_jit::idiv(ZydisDecodedInstruction *instr)
 	case 0xF7: {
 		assert(instr->raw.modrm.reg == 7);
 
+		const void *helper_fn = nullptr;
 		switch (m_cpu->size_mode)
 		{
 		case SIZE8:
@@ -4382,7 +5354,7 @@ lc86_jit::idiv(ZydisDecodedInstruction *instr)
 					LD_MEM();
 					MOV(DL, AL);
 				});
-			MOV(RAX, &idivb_helper);
+			helper_fn = reinterpret_cast<const void *>(&idivb_helper);
 			break;
 
 		case SIZE16:
@@ -4396,7 +5368,7 @@ lc86_jit::idiv(ZydisDecodedInstruction *instr)
 					LD_MEM();
 					MOV(DX, AX);
 				});
-			MOV(RAX, &idivw_helper);
+			helper_fn = reinterpret_cast<const void *>(&idivw_helper);
 			break;
 
 		case SIZE32:
@@ -4410,7 +5382,7 @@ lc86_jit::idiv(ZydisDecodedInstruction *instr)
 					LD_MEM();
 					MOV(EDX, EAX);
 				});
-			MOV(RAX, &idivd_helper);
+			helper_fn = reinterpret_cast<const void *>(&idivd_helper);
 			break;
 
 		default:
@@ -4419,7 +5391,7 @@ lc86_jit::idiv(ZydisDecodedInstruction *instr)
 
 		Label ok = m_a.newLabel();
 		MOV(R8D, m_cpu->instr_eip);
-		CALL(RAX);
+		CALL_F(helper_fn);
 		RELOAD_RCX_CTX();
 		CMP(AL, 0);
 		BR_EQ(ok);
@@ -4682,8 +5654,7 @@ lc86_jit::int3(ZydisDecodedInstruction *instr)
 	MOV(MEMD16(RCX, CPU_EXP_CODE), 0);
 	MOV(MEMD16(RCX, CPU_EXP_IDX), EXP_BP);
 	MOV(MEMD32(RCX, CPU_EXP_EIP), m_cpu->instr_eip + m_cpu->instr_bytes);
-	MOV(RAX, &cpu_raise_exception<true>);
-	CALL(RAX);
+	CALL_F(&cpu_raise_exception<true>);
 	gen_epilogue_main<false>();
 
 	m_needs_epilogue = false;
@@ -4699,8 +5670,7 @@ lc86_jit::iret(ZydisDecodedInstruction *instr)
 		Label exp = m_a.newLabel();
 		MOV(R8D, m_cpu->instr_eip);
 		MOV(DL, m_cpu->size_mode);
-		MOV(RAX, &lret_pe_helper<true>);
-		CALL(RAX);
+		CALL_F(&lret_pe_helper<true>);
 		RELOAD_RCX_CTX();
 		CMP(AL, 0);
 		BR_NE(exp);
@@ -4711,8 +5681,7 @@ lc86_jit::iret(ZydisDecodedInstruction *instr)
 	else {
 		MOV(R8D, m_cpu->instr_eip);
 		MOV(DL, m_cpu->size_mode);
-		MOV(RAX, &iret_real_helper);
-		CALL(RAX);
+		CALL_F(&iret_real_helper);
 		RELOAD_RCX_CTX();
 		link_ret_emit();
 	}
@@ -4981,6 +5950,9 @@ lc86_jit::jmp(ZydisDecodedInstruction *instr)
 		if (m_cpu->size_mode == SIZE16) {
 			new_eip &= 0x0000FFFF;
 		}
+		if (trace_follow_direct(m_cpu->cpu_ctx.regs.cs_hidden.base + new_eip)) {
+			return;
+		}
 		ST_R32(CPU_CTX_EIP, new_eip);
 		link_direct_emit(m_cpu->cpu_ctx.regs.cs_hidden.base + new_eip, nullptr, m_cpu->cpu_ctx.regs.cs_hidden.base + new_eip);
 		m_cpu->tc->flags |= TC_FLG_DIRECT;
@@ -4996,8 +5968,7 @@ lc86_jit::jmp(ZydisDecodedInstruction *instr)
 			MOV(R9D, new_eip);
 			MOV(R8B, m_cpu->size_mode);
 			MOV(DX, new_sel);
-			MOV(RAX, &ljmp_pe_helper);
-			CALL(RAX);
+			CALL_F(&ljmp_pe_helper);
 			RELOAD_RCX_CTX();
 			CMP(AL, 0);
 			BR_NE(exp);
@@ -5060,7 +6031,7 @@ lc86_jit::lahf(ZydisDecodedInstruction *instr)
 	MOVZX(EAX, MEMD8(RCX, CPU_CTX_EFLAGS_AUX + 1));
 	MOVZX(EBX, DL);
 	XOR(RBX, RAX);
-	MOV(RAX, &m_cpu->cpu_ctx.lazy_eflags.parity);
+	MOV_PTR(RAX, &m_cpu->cpu_ctx.lazy_eflags.parity);
 	MOVZX(R8D, MEMS8(RBX, RAX, 0));
 	XOR(EAX, EAX);
 	XOR(R8D, 1);
@@ -5385,8 +6356,7 @@ lc86_jit::mov(ZydisDecodedInstruction *instr)
 				MOV(MEMD32(RSP, STACK_ARGS_off), m_cpu->instr_bytes);
 				MOV(R9D, m_cpu->instr_eip);
 				MOV(R8D, cr_idx - CR_offset);
-				MOV(RAX, &update_crN_helper);
-				CALL(RAX);
+				CALL_F(&update_crN_helper);
 				RELOAD_RCX_CTX();
 				CMP(AL, 0);
 				BR_EQ(ok);
@@ -5431,8 +6401,7 @@ lc86_jit::mov(ZydisDecodedInstruction *instr)
 			case DR2_idx:
 			case DR3_idx: {
 				MOV(DL, dr_idx);
-				MOV(RAX, &update_drN_helper);
-				CALL(RAX);
+				CALL_F(&update_drN_helper);
 				RELOAD_RCX_CTX();
 			}
 			break;
@@ -5477,6 +6446,10 @@ lc86_jit::mov(ZydisDecodedInstruction *instr)
 					AND(EAX, 3);
 					CMP(EAX, DR7_TYPE_IO_RW); // check if it is a mem or io watchpoint
 					BR_EQ(io);
+#ifdef LIB86CPU_COMPACT_TLB
+					// the watchpoints of the compact tlb are updated by tlb_update_watch, after dr7 is written
+					BR_UNCOND(exit);
+#else
 					LEA(RBX, MEMD64(RCX, CPU_CTX_TLB));
 					MOV(EDX, R8D);
 					SHR(EDX, idx * 2);
@@ -5495,13 +6468,13 @@ lc86_jit::mov(ZydisDecodedInstruction *instr)
 					AND(EDX, ~TLB_WATCH);
 					MOV(MEMS32(RBX, RAX, 2), EDX); // remove disabled watchpoint
 					BR_UNCOND(exit);
+#endif
 					m_a.bind(io);
 					TEST(R9D, R9D);
 					BR_EQ(exit);
 					// we don't support io watchpoints yet so for now we just abort
-					MOV(RCX, abort_msg);
-					MOV(RAX, &cpu_runtime_abort); // won't return
-					CALL(RAX);
+					MOV_PTR(RCX, abort_msg);
+					CALL_F(&cpu_runtime_abort); // won't return
 					INT3();
 					m_a.bind(exit);
 				}
@@ -5515,6 +6488,12 @@ lc86_jit::mov(ZydisDecodedInstruction *instr)
 			if ((dr_idx != DR0_idx) && (dr_idx != DR1_idx) && (dr_idx != DR2_idx) && (dr_idx != DR3_idx)) {
 				ST_R32(dr_offset, R8D);
 			}
+#ifdef LIB86CPU_COMPACT_TLB
+			if (dr_offset == REG_off(ZYDIS_REGISTER_DR7)) {
+				CALL_F(&tlb_update_watch);
+				RELOAD_RCX_CTX();
+			}
+#endif
 			ST_R32(CPU_CTX_EIP, m_cpu->instr_eip + m_cpu->instr_bytes);
 			// instr breakpoint are checked at compile time, so we cannot jump to the next tc if we are writing to anything but dr6
 			if ((((m_cpu->virt_pc + m_cpu->instr_bytes) & ~PAGE_MASK) == (m_cpu->virt_pc & ~PAGE_MASK)) && (dr_idx == DR6_idx)) {
@@ -5597,8 +6576,7 @@ lc86_jit::mov(ZydisDecodedInstruction *instr)
 				Label ok = m_a.newLabel();
 				MOV(R8D, m_cpu->instr_eip);
 				MOV(DX, AX);
-				MOV(RAX, &mov_sel_pe_helper<SS_idx>);
-				CALL(RAX);
+				CALL_F(&mov_sel_pe_helper<SS_idx>);
 				RELOAD_RCX_CTX();
 				CMP(AL, 0);
 				BR_EQ(ok);
@@ -5614,22 +6592,23 @@ lc86_jit::mov(ZydisDecodedInstruction *instr)
 				MOV(R8D, m_cpu->instr_eip);
 				MOV(DX, AX);
 
+				const void *helper_fn = nullptr;
 				switch (REG_idx(instr->operands[OPNUM_DST].reg.value))
 				{
 				case DS_idx:
-					MOV(RAX, &mov_sel_pe_helper<DS_idx>);
+					helper_fn = reinterpret_cast<const void *>(&mov_sel_pe_helper<DS_idx>);
 					break;
 
 				case ES_idx:
-					MOV(RAX, &mov_sel_pe_helper<ES_idx>);
+					helper_fn = reinterpret_cast<const void *>(&mov_sel_pe_helper<ES_idx>);
 					break;
 
 				case FS_idx:
-					MOV(RAX, &mov_sel_pe_helper<FS_idx>);
+					helper_fn = reinterpret_cast<const void *>(&mov_sel_pe_helper<FS_idx>);
 					break;
 
 				case GS_idx:
-					MOV(RAX, &mov_sel_pe_helper<GS_idx>);
+					helper_fn = reinterpret_cast<const void *>(&mov_sel_pe_helper<GS_idx>);
 					break;
 
 				default:
@@ -5637,7 +6616,7 @@ lc86_jit::mov(ZydisDecodedInstruction *instr)
 				}
 
 				Label ok = m_a.newLabel();
-				CALL(RAX);
+				CALL_F(helper_fn);
 				RELOAD_RCX_CTX();
 				CMP(AL, 0);
 				BR_EQ(ok);
@@ -6242,26 +7221,27 @@ lc86_jit::pop(ZydisDecodedInstruction *instr)
 			MOV(R8D, m_cpu->instr_eip);
 			MOV(DX, R11W);
 
+			const void *helper_fn = nullptr;
 			switch (sel.first)
 			{
 			case SS_idx:
-				MOV(RAX, &mov_sel_pe_helper<SS_idx>);
+				helper_fn = reinterpret_cast<const void *>(&mov_sel_pe_helper<SS_idx>);
 				break;
 
 			case FS_idx:
-				MOV(RAX, &mov_sel_pe_helper<FS_idx>);
+				helper_fn = reinterpret_cast<const void *>(&mov_sel_pe_helper<FS_idx>);
 				break;
 
 			case GS_idx:
-				MOV(RAX, &mov_sel_pe_helper<GS_idx>);
+				helper_fn = reinterpret_cast<const void *>(&mov_sel_pe_helper<GS_idx>);
 				break;
 
 			case ES_idx:
-				MOV(RAX, &mov_sel_pe_helper<ES_idx>);
+				helper_fn = reinterpret_cast<const void *>(&mov_sel_pe_helper<ES_idx>);
 				break;
 
 			case DS_idx:
-				MOV(RAX, &mov_sel_pe_helper<DS_idx>);
+				helper_fn = reinterpret_cast<const void *>(&mov_sel_pe_helper<DS_idx>);
 				break;
 
 			default:
@@ -6269,7 +7249,7 @@ lc86_jit::pop(ZydisDecodedInstruction *instr)
 			}
 
 			Label ok = m_a.newLabel();
-			CALL(RAX);
+			CALL_F(helper_fn);
 			RELOAD_RCX_CTX();
 			CMP(AL, 0);
 			BR_EQ(ok);
@@ -6628,7 +7608,7 @@ lc86_jit::pushf(ZydisDecodedInstruction *instr)
 	MOVZX(EAX, MEMD8(RCX, CPU_CTX_EFLAGS_AUX + 1));
 	MOVZX(EBX, DL);
 	XOR(RBX, RAX);
-	MOV(RAX, &m_cpu->cpu_ctx.lazy_eflags.parity);
+	MOV_PTR(RAX, &m_cpu->cpu_ctx.lazy_eflags.parity);
 	MOVZX(R9D, MEMS8(RBX, RAX, 0));
 	XOR(EAX, EAX);
 	XOR(R9D, 1);
@@ -6689,8 +7669,7 @@ lc86_jit::rdmsr(ZydisDecodedInstruction *instr)
 	}
 	else {
 		Label ok = m_a.newLabel();
-		MOV(RAX, &msr_read_helper);
-		CALL(RAX);
+		CALL_F(&msr_read_helper);
 		RELOAD_RCX_CTX();
 		CMP(AL, 0);
 		BR_EQ(ok);
@@ -6712,15 +7691,14 @@ lc86_jit::rdtsc(ZydisDecodedInstruction *instr)
 		m_a.bind(ok);
 	}
 
-	MOV(RAX, &cpu_rdtsc_handler);
-	CALL(RAX);
+	CALL_F(&cpu_rdtsc_handler);
 	RELOAD_RCX_CTX();
 }
 
 void
 lc86_jit::ret(ZydisDecodedInstruction *instr)
 {
-	bool has_imm_op = false;
+	bool has_imm_op = false, is_near = false;
 	switch (instr->opcode)
 	{
 	case 0xC2:
@@ -6728,6 +7706,7 @@ lc86_jit::ret(ZydisDecodedInstruction *instr)
 		[[fallthrough]];
 
 	case 0xC3: {
+		is_near = true;
 		stack_pop_emit<1>();
 		if (m_cpu->size_mode == SIZE16) {
 			MOVZX(R11D, R11W);
@@ -6757,8 +7736,7 @@ lc86_jit::ret(ZydisDecodedInstruction *instr)
 			Label ok = m_a.newLabel();
 			MOV(R8D, m_cpu->instr_eip);
 			MOV(DL, m_cpu->size_mode);
-			MOV(RAX, &lret_pe_helper<false>);
-			CALL(RAX);
+			CALL_F(&lret_pe_helper<false>);
 			RELOAD_RCX_CTX();
 			CMP(AL, 0);
 			BR_EQ(ok);
@@ -6800,7 +7778,12 @@ lc86_jit::ret(ZydisDecodedInstruction *instr)
 		LIB86CPU_ABORT();
 	}
 
-	link_ret_emit();
+	if (is_near) {
+		link_ret_emit<true>();
+	}
+	else {
+		link_ret_emit();
+	}
 	m_cpu->tc->flags |= TC_FLG_RET;
 	m_cpu->translate_next = 0;
 }
@@ -7555,8 +8538,7 @@ lc86_jit::wrmsr(ZydisDecodedInstruction *instr)
 	}
 	else {
 		Label ok = m_a.newLabel();
-		MOV(RAX, &msr_write_helper);
-		CALL(RAX);
+		CALL_F(&msr_write_helper);
 		RELOAD_RCX_CTX();
 		CMP(AL, 0);
 		BR_EQ(ok);
@@ -16,6 +16,11 @@
 
 using namespace asmjit;
 
+#define RA_NUM_GUEST_REGS 8 // eax, ecx, edx, ebx, esp, ebp, esi, edi
+#define RA_NUM_HOST_REGS  7 // rsi, rdi, rbp, r12, r13, r14, r15
+
+#define HELPER_STUB_SIZE       16
+#define HELPER_STUB_TABLE_SIZE 4096
 
 // val: value of immediate or offset of referenced register, bits: size in bits of val
 struct op_info {
@@ -29,12 +34,17 @@ class lc86_jit : public Target {
 public:
 	lc86_jit(cpu_t *cpu);
 	void gen_code_block();
+	bool get_code_block(tc_code_t &code);
+	bool load_code_block(const tc_code_t &code);
 	void gen_tc_prologue() { start_new_session(); gen_prologue_main(); }
 	void gen_tc_epilogue();
 	void gen_int_fn();
 	void hook_emit(void *hook_addr);
+	void reg_alloc_instr(ZydisDecodedInstruction *instr);
 	void raise_exp_inline_emit(uint32_t fault_addr, uint16_t code, uint16_t idx, uint32_t eip);
 	void free_code_block(void *addr) { m_mem.release_sys_mem(addr); }
+	void patch_jmp(translated_code_t *tc, unsigned jmp_idx, entry_t target);
+	void end_patches();
 	void destroy_all_code() { m_mem.destroy_all_blocks(); }
 
 	void aaa(ZydisDecodedInstruction *instr);
@@ -138,9 +148,11 @@ public:
 
 #if defined(_WIN64)
 	uint8_t *gen_exception_info(uint8_t *code_ptr, size_t code_size);
+	void gen_run_code_exception_info(uint8_t *code_ptr, size_t code_size);
 
 private:
 	void create_unwind_info();
+	uint8_t *write_exception_info(uint8_t *code_ptr, size_t code_size, const uint8_t *unwind_info, size_t unwind_info_size);
 
 	uint8_t m_unwind_info[4 + 12];
 #endif
@@ -151,14 +163,33 @@ private:
 	template<bool set_ret = true>
 	void gen_epilogue_main();
 	void gen_tail_call(x86::Gp addr);
+	void gen_tail_call_direct(unsigned jmp_idx);
 	void gen_int_fn(bool is_raise);
+	void gen_run_code_fn();
+	void gen_helper_stubs();
+	const uint8_t *get_helper_stub(const void *fn);
+	const uint8_t *get_helper_target(const void *fn);
+	void call_helper_emit(const void *fn);
+	void fix_helper_call(uint8_t *ret_addr, const void *fn);
+	void mov_ptr_emit(x86::Gp dst, const void *ptr);
+	mem_block alloc_code_block(size_t code_size);
+	void finish_code_block(const mem_block &block, uint8_t *main_offset, size_t code_size, const uint32_t *jmp_rel32);
+	void reg_alloc_reset();
+	void reg_alloc_writeback_emit();
+	void reg_alloc_flush_emit();
+	bool reg_alloc_is_supported(ZydisDecodedInstruction *instr);
+	int reg_alloc_get_slot(size_t reg_offset);
 	void check_int_emit();
 	bool check_rf_single_step_emit();
 	template<typename T>
 	void link_direct_emit(addr_t dst_pc, addr_t *next_pc, T target_addr);
 	void link_dst_only_emit();
+	template<bool use_rsb = false>
 	void link_indirect_emit();
+	template<bool use_rsb = false>
 	void link_ret_emit();
+	void rsb_push_emit(addr_t ret_pc);
+	bool trace_follow_direct(addr_t dst_pc);
 	template<bool terminates, typename T1, typename T2, typename T3, typename T4>
 	void raise_exp_inline_emit(T1 fault_addr, T2 code, T3 idx, T4 eip);
 	template<bool terminates>
@@ -205,6 +236,10 @@ private:
 	void load_reg(x86::Gp dst, size_t reg_offset, size_t size);
 	template<typename T>
 	void store_reg(T val, size_t reg_offset, size_t size);
+	template<bool is_write>
+	void tlb_lookup_emit(Label slow, uint8_t size, uint8_t is_priv, Label code_page = Label());
+	void tlb_lookup_code_emit(Label slow, uint8_t is_priv);
+	void tlb_host_addr_emit();
 	void load_mem(uint8_t size, uint8_t is_priv);
 	template<typename T>
 	void store_mem(T val, uint8_t size, uint8_t is_priv);
@@ -238,7 +273,20 @@ private:
 	CodeHolder m_code;
 	x86::Assembler m_a;
 	bool m_needs_epilogue;
+	Label m_jmp_label[2]; // bound right after the patchable jmp of jmp_offset[0/1], see gen_tail_call_direct
+	Label m_entry_label; // bound right after the prologue of the tc, used by back-edges to the start of the tc, see link_direct_emit
 	mem_manager m_mem;
+	std::vector<std::pair<Label, const void *>> m_helper_calls; // return address of the helper calls of this session and their helper, see call_helper_emit
+	std::vector<std::pair<Label, const void *>> m_ptr_movs; // end of the pointers loaded in this session and their value, see mov_ptr_emit
+	std::unordered_map<const void *, const uint8_t *> m_helper_stubs; // helper -> its stub in the helper stub table
+	mem_block m_helper_stub_block;
+	unsigned m_num_helper_stubs;
+	// block-local guest register allocation state, see reg_alloc_instr
+	int8_t m_ra_slot[RA_NUM_GUEST_REGS];   // guest gpr idx -> host reg slot, -1 if not cached
+	int8_t m_ra_guest[RA_NUM_HOST_REGS];   // host reg slot -> guest gpr idx, -1 if free
+	uint32_t m_ra_age[RA_NUM_HOST_REGS];   // last instr that used the slot, for lru eviction
+	uint32_t m_ra_clock;
+	uint8_t m_ra_dirty;                    // mask of cached guest gprs that were modified after they were loaded
 };
 
 #endif
@@ -866,9 +866,9 @@ update_drN_helper(cpu_ctx_t *cpu_ctx, uint8_t dr_idx, uint32_t new_dr)
 			size_t wp_len = cpu_get_watchpoint_lenght(cpu_ctx->cpu, dr_idx - DR_offset);
 			uint32_t tlb_idx1 = dr >> PAGE_SHIFT;
 			uint32_t tlb_idx2 = (dr + wp_len - 1) >> PAGE_SHIFT;
-			cpu_ctx->tlb[tlb_idx1] &= ~TLB_WATCH;
+			tlb_clear(cpu_ctx->cpu, tlb_idx1, TLB_WATCH);
 			if (tlb_idx1 != tlb_idx2) {
-				cpu_ctx->tlb[tlb_idx2] &= ~TLB_WATCH;
+				tlb_clear(cpu_ctx->cpu, tlb_idx2, TLB_WATCH);
 			}
 			cpu_ctx->regs.dr[dr_idx - DR_offset] = new_dr;
 			for (int idx = 0; idx < 4; ++idx) {
@@ -877,9 +877,9 @@ update_drN_helper(cpu_ctx_t *cpu_ctx, uint8_t dr_idx, uint32_t new_dr)
 					dr = cpu_ctx->regs.dr[idx];
 					tlb_idx1 = dr >> PAGE_SHIFT;
 					tlb_idx2 = (dr + wp_len - 1) >> PAGE_SHIFT;
-					cpu_ctx->tlb[tlb_idx1] |= TLB_WATCH;
+					tlb_write(cpu_ctx->cpu, tlb_idx1) |= TLB_WATCH;
 					if (tlb_idx1 != tlb_idx2) {
-						cpu_ctx->tlb[tlb_idx2] |= TLB_WATCH;
+						tlb_write(cpu_ctx->cpu, tlb_idx2) |= TLB_WATCH;
 					}
 				}
 			}
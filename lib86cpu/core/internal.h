@@ -17,6 +17,10 @@ template<bool should_flush_tlb>
 void tc_should_clear_cache_and_tlb(cpu_t *cpu, addr_t start, addr_t end);
 void tc_cache_clear(cpu_t *cpu);
 void tc_cache_purge(cpu_t *cpu);
+lc86_status tc_file_open(cpu_t *cpu, const char *path);
+bool tc_smc_overlaps(cpu_ctx_t *cpu_ctx, addr_t phys_addr, uint32_t size);
+uint64_t *tc_smc_page(cpu_t *cpu, addr_t phys_addr);
+void tc_smc_set_ram_start(cpu_t *cpu, addr_t ram_start);
 addr_t get_pc(cpu_ctx_t *cpu_ctx);
 template<bool is_int = false> translated_code_t *cpu_raise_exception(cpu_ctx_t *cpu_ctx);
 translated_code_t *cpu_do_int(cpu_ctx_t *cpu_ctx, uint32_t int_flg);
@@ -55,8 +59,9 @@ translated_code_t *cpu_do_int(cpu_ctx_t *cpu_ctx, uint32_t int_flg);
 // disassembly context flags
 #define DISAS_FLG_CS32         (1 << 0)
 #define DISAS_FLG_PAGE_CROSS   (1 << 2)
-#define DISAS_FLG_FETCH_FAULT  DISAS_FLG_PAGE_CROSS
-#define DISAS_FLG_DBG_FAULT    DISAS_FLG_PAGE_CROSS
+#define DISAS_FLG_FAULT        (1 << 3)
+#define DISAS_FLG_FETCH_FAULT  (DISAS_FLG_PAGE_CROSS | DISAS_FLG_FAULT)
+#define DISAS_FLG_DBG_FAULT    (DISAS_FLG_PAGE_CROSS | DISAS_FLG_FAULT)
 #define DISAS_FLG_ONE_INSTR    CPU_DISAS_ONE
 
 // tc struct flags/offsets
@@ -69,6 +74,9 @@ translated_code_t *cpu_do_int(cpu_ctx_t *cpu_ctx, uint32_t int_flg);
 #define TC_FLG_JMP_TAKEN       (3 << 4)
 #define TC_FLG_RET             (1 << 6)
 #define TC_FLG_DST_ONLY        (1 << 7)  // jump(dest_pc)
+#define TC_FLG_TRACE           (1 << 8)  // tc continues at the destination of direct jmp/call instrs in its page
+#define TC_FLG_PAGE_CROSS      (1 << 9)  // last instr of the tc crosses pages
+#define TC_FLG_TIER0           (1 << 10) // tc was translated by the cheap tier of CPU_TIERED_JIT
 #define TC_FLG_LINK_MASK  (TC_FLG_INDIRECT | TC_FLG_DIRECT | TC_FLG_RET | TC_FLG_DST_ONLY)
 
 // segment descriptor flags
@@ -52,32 +52,128 @@ correct_phys_addr(cpu_t *cpu, addr_t phys_addr, const memory_region_t<addr_t> *&
 	return phys_addr & cpu->a20_mask;
 }
 
+static uint8_t *
+ram_host_ptr(cpu_t *cpu, addr_t phys_addr, size_t size, const memory_region_t<addr_t> *region)
+{
+	// returns the host address of phys_addr if all of its size bytes are in the ram region, which must be the one returned by correct_phys_addr
+	if ((region->type == mem_type::ram) && (phys_addr >= region->start) && ((phys_addr + size - 1) <= region->end)) {
+		return static_cast<uint8_t *>(get_ram_host_ptr(cpu, phys_addr));
+	}
+
+	return nullptr;
+}
+
+static void
+pde_cache_flush(cpu_t *cpu)
+{
+	// Everything that changes where a pde or a page table is, that is cr3, the a20 gate and the memory regions, also flushes the tlb, so this only
+	// needs to be called by tlb_flush. Instead of clearing the entries, this changes the generation, and they are cleared only when it wraps around
+	if (++cpu->pde_cache_gen == 0) {
+		for (pde_cache_t &pde_cache : cpu->pde_cache) {
+			pde_cache.gen = 0;
+		}
+		cpu->pde_cache_gen = 1;
+	}
+}
+
+#ifdef LIB86CPU_COMPACT_TLB
+uint32_t
+tlb_watch_mask(cpu_t *cpu, uint32_t tlb_idx)
+{
+	// The compact tlb can't keep TLB_WATCH for the pages it evicts, so this finds it again from the enabled memory watchpoints. This is what the direct
+	// tlb would hold, since the watchpoint flags are only set there by writes to the debug regs
+	if ((cpu->cpu_ctx.regs.dr[7] & 0xFF) == 0) {
+		return 0;
+	}
+
+	for (int idx = 0; idx < 4; ++idx) {
+		if (cpu_check_watchpoint_enabled(cpu, idx) && (cpu_get_watchpoint_type(cpu, idx) != DR7_TYPE_IO_RW)) {
+			uint32_t dr = cpu->cpu_ctx.regs.dr[idx];
+			if (((dr >> PAGE_SHIFT) <= tlb_idx) && (((dr + cpu_get_watchpoint_lenght(cpu, idx) - 1) >> PAGE_SHIFT) >= tlb_idx)) {
+				return TLB_WATCH;
+			}
+		}
+	}
+
+	return 0;
+}
+
+void
+tlb_update_watch(cpu_ctx_t *cpu_ctx)
+{
+	// called by the jitted code after a write to dr7, to update TLB_WATCH of the pages in the compact tlb
+	for (tlb_slot_t &slot : cpu_ctx->tlb) {
+		if (slot.tag != TLB_TAG_EMPTY) {
+			slot.entry = (slot.entry & ~TLB_WATCH) | tlb_watch_mask(cpu_ctx->cpu, slot.tag >> PAGE_SHIFT);
+		}
+	}
+}
+#else
+void
+tlb_track(cpu_t *cpu, uint32_t tlb_idx)
+{
+	// must be called before a tlb entry that could be zero is written with a non zero value, so that tlb_flush knows about it
+	if (!cpu->tlb_used_map.test(tlb_idx)) {
+		cpu->tlb_used_map.set(tlb_idx);
+		cpu->tlb_used.push_back(tlb_idx);
+	}
+}
+#endif
+
+static uint32_t
+tlb_code_mask(cpu_t *cpu, addr_t phys_addr)
+{
+	// Returns TLB_CODE if the page of phys_addr has translated code. This can't be taken from the old tlb entry, because the compact tlb loses it when a
+	// page is evicted, and a flushed entry could have been for another page. Ram pages use their granules, which can only have stale bits that are set
+	if (uint64_t *smc = tc_smc_page(cpu, phys_addr)) {
+		return *smc ? TLB_CODE : 0;
+	}
+
+	return cpu->tc_page_map.contains(phys_addr >> PAGE_SHIFT) ? TLB_CODE : 0;
+}
+
 static addr_t
 tlb_fill(cpu_t *cpu, addr_t addr, addr_t phys_addr, uint32_t prot)
 {
 	assert((prot & ~PAGE_MASK) == 0);
 
-	unsigned tlb_idx = addr >> PAGE_SHIFT;
+#ifdef LIB86CPU_COMPACT_TLB
+	if (cpu->subpages.size() >= TLB_MAX_SUBPAGES) {
+		// the subpages of the pages evicted from the compact tlb are not reused, so they are only freed by a flush
+		tlb_flush(cpu, TLB_keep_cw);
+	}
+#endif
+
+	uint32_t tlb_idx = addr >> PAGE_SHIFT;
+	uint32_t &tlb_entry = tlb_write(cpu, tlb_idx);
 	const memory_region_t<addr_t> *region = as_memory_search_addr(cpu, phys_addr);
 	addr_t start_page = phys_addr & ~PAGE_MASK;
 	addr_t end_page = ((static_cast<uint64_t>(phys_addr) + PAGE_SIZE) & ~PAGE_MASK) - 1; // the cast avoids overflow on the last page at 0xFFFFF000
 	phys_addr = correct_phys_addr(cpu, phys_addr, region);
+	prot |= tlb_code_mask(cpu, phys_addr);
 
 	if ((region->start <= start_page) && (region->end >= end_page)) {
 		// region spans the entire page
 
 		if (region->type == mem_type::ram) {
-			cpu->cpu_ctx.tlb[tlb_idx] = (phys_addr & ~PAGE_MASK) | (prot | TLB_RAM) | (cpu->cpu_ctx.tlb[tlb_idx] & TLB_WATCH);
+			tlb_entry = (phys_addr & ~PAGE_MASK) | (prot | TLB_RAM) | (tlb_entry & TLB_WATCH);
+			tlb_host_addend(cpu, tlb_idx) = reinterpret_cast<uintptr_t>(get_ram_host_ptr(cpu, phys_addr & ~PAGE_MASK)) - (addr & ~PAGE_MASK);
+		}
+		else if (region->type == mem_type::rom) {
+			// rom pages are accessed through their host addend like ram pages, so they don't need a subpage
+			prot &= ~TLB_CODE;
+			tlb_entry = (phys_addr & ~PAGE_MASK) | (prot | TLB_ROM) | (tlb_entry & TLB_WATCH);
+			tlb_host_addend(cpu, tlb_idx) = reinterpret_cast<uintptr_t>(get_rom_host_ptr(region, phys_addr & ~PAGE_MASK)) - (addr & ~PAGE_MASK);
 		}
 		else if (region->type == mem_type::unmapped) {
-			cpu->cpu_ctx.tlb[tlb_idx] = (phys_addr & ~PAGE_MASK) | prot | (cpu->cpu_ctx.tlb[tlb_idx] & TLB_WATCH);
+			tlb_entry = (phys_addr & ~PAGE_MASK) | prot | (tlb_entry & TLB_WATCH);
 		}
 		else {
 			subpage_t *subpage;
 			uint32_t subpage_idx;
-			if (cpu->cpu_ctx.tlb[tlb_idx] & (TLB_ROM | TLB_MMIO)) {
+			if (tlb_entry & TLB_MMIO) {
 				// don't add duplicates
-				subpage_idx = cpu->cpu_ctx.tlb[tlb_idx] >> PAGE_SHIFT;
+				subpage_idx = tlb_entry >> PAGE_SHIFT;
 				subpage = &cpu->subpages[subpage_idx];
 			}
 			else {
@@ -101,14 +197,7 @@ tlb_fill(cpu_t *cpu, addr_t addr, addr_t phys_addr, uint32_t prot)
 				subpage->cached_region_idx[0] = it - cpu->cached_regions.begin();
 			}
 
-			if (region->type == mem_type::mmio) {
-				prot |= TLB_MMIO;
-			}
-			else {
-				prot &= ~TLB_CODE;
-				prot |= TLB_ROM;
-			}
-			cpu->cpu_ctx.tlb[tlb_idx] = (subpage_idx << PAGE_SHIFT) | prot | (cpu->cpu_ctx.tlb[tlb_idx] & TLB_WATCH);
+			tlb_entry = (subpage_idx << PAGE_SHIFT) | (prot | TLB_MMIO) | (tlb_entry & TLB_WATCH);
 		}
 	}
 	else {
@@ -116,9 +205,9 @@ tlb_fill(cpu_t *cpu, addr_t addr, addr_t phys_addr, uint32_t prot)
 
 		subpage_t *subpage;
 		uint32_t subpage_idx;
-		if (cpu->cpu_ctx.tlb[tlb_idx] & TLB_SUBPAGE) {
+		if (tlb_entry & TLB_SUBPAGE) {
 			// don't add duplicates
-			subpage_idx = cpu->cpu_ctx.tlb[tlb_idx] >> PAGE_SHIFT;
+			subpage_idx = tlb_entry >> PAGE_SHIFT;
 			subpage = &cpu->subpages[subpage_idx];
 		}
 		else {
@@ -149,15 +238,123 @@ tlb_fill(cpu_t *cpu, addr_t addr, addr_t phys_addr, uint32_t prot)
 			subpage->cached_region_idx[idx] = region_idx;
 		}
 
-		cpu->cpu_ctx.tlb[tlb_idx] = (subpage_idx << PAGE_SHIFT) | (prot | TLB_SUBPAGE) | (cpu->cpu_ctx.tlb[tlb_idx] & TLB_WATCH);
+		tlb_entry = (subpage_idx << PAGE_SHIFT) | (prot | TLB_SUBPAGE) | (tlb_entry & TLB_WATCH);
 	}
 
 	return phys_addr;
 }
 
+static addr_t
+tlb_fill_large(cpu_t *cpu, addr_t addr, addr_t phys_addr, uint32_t prot, uint32_t span_prot)
+{
+	// Fills the tlb entry of addr, which is mapped by a 4 MiB page, like tlb_fill. When the whole large page is ram, this also fills the entries of
+	// its other pages that are not already valid, so that a scan of the large page misses the tlb once instead of once every 4 KiB. These use
+	// span_prot, which doesn't have TLB_DIRTY unless the pde is dirty, so that the first write to them still sets the dirty flag of the pde.
+	// Invalidating them needs nothing more, since all the entries are tracked and flushed like the others by tlb_flush. The compact tlb has as many
+	// slots as a large page has pages, so there this would evict all of them and only the entry of addr is filled
+	addr_t fill_addr = tlb_fill(cpu, addr, phys_addr, prot);
+
+#ifndef LIB86CPU_COMPACT_TLB
+	// the a20 gate masks a bit in the middle of the large page, so its pages are only contiguous when the gate is open
+	if (cpu->a20_mask != 0xFFFFFFFF) {
+		return fill_addr;
+	}
+
+	addr_t large_page = phys_addr & ~PAGE_MASK_LARGE;
+	const memory_region_t<addr_t> *region = as_memory_search_addr(cpu, large_page);
+	if ((region->start > large_page) || (region->end < (large_page + PAGE_MASK_LARGE))) {
+		return fill_addr;
+	}
+
+	large_page = correct_phys_addr(cpu, large_page, region);
+	uint8_t *host_ptr = ram_host_ptr(cpu, large_page, PAGE_SIZE_LARGE, region);
+	if (host_ptr == nullptr) {
+		return fill_addr;
+	}
+
+	uint32_t start_idx = (addr & ~PAGE_MASK_LARGE) >> PAGE_SHIFT;
+	uintptr_t host_addend = reinterpret_cast<uintptr_t>(host_ptr) - (addr & ~PAGE_MASK_LARGE);
+	for (uint32_t idx = 0; idx < (PAGE_SIZE_LARGE >> PAGE_SHIFT); ++idx) {
+		uint32_t tlb_idx = start_idx + idx;
+		uint32_t tlb_entry = tlb_read(cpu, tlb_idx);
+		if (tlb_entry & (TLB_SUP_READ | TLB_SUP_WRITE | TLB_USER_READ | TLB_USER_WRITE)) {
+			// already valid, which is always the case for the entry of addr
+			continue;
+		}
+
+		addr_t page = large_page + (idx << PAGE_SHIFT);
+		tlb_write(cpu, tlb_idx) = page | (span_prot | TLB_RAM | tlb_code_mask(cpu, page)) | (tlb_entry & TLB_WATCH);
+		tlb_host_addend(cpu, tlb_idx) = host_addend;
+	}
+#endif
+
+	return fill_addr;
+}
+
+#ifdef LIB86CPU_COMPACT_TLB
 void
 tlb_flush(cpu_t *cpu, int n)
 {
+	// The compact tlb is small enough to be swept on every flush. TLB_WATCH doesn't need to be preserved like with the direct tlb, because tlb_write
+	// finds it again when a page is added back
+	switch (n)
+	{
+	case TLB_zero:
+		for (tlb_slot_t &slot : cpu->cpu_ctx.tlb) {
+			slot.tag = TLB_TAG_EMPTY;
+			slot.entry = 0;
+		}
+		break;
+
+	case TLB_keep_cw:
+		for (tlb_slot_t &slot : cpu->cpu_ctx.tlb) {
+			slot.entry &= (TLB_CODE | TLB_WATCH);
+		}
+		break;
+
+	case TLB_no_g:
+		for (tlb_slot_t &slot : cpu->cpu_ctx.tlb) {
+			if (!(slot.entry & TLB_GLOBAL)) {
+				slot.entry &= (TLB_CODE | TLB_WATCH);
+			}
+		}
+		break;
+
+	default:
+		LIB86CPU_ABORT();
+	}
+
+	cpu->subpages.clear();
+	pde_cache_flush(cpu);
+	// the rsb is probed without checking the page of the ret, so its entries must not outlive the mappings they were pushed with
+	std::fill(std::begin(cpu->cpu_ctx.rsb), std::end(cpu->cpu_ctx.rsb), ibtc_entry_t());
+}
+#else
+template<typename F>
+static void
+tlb_flush_used(cpu_t *cpu, F &&flush_entry)
+{
+	// flushes the entries in tlb_used with flush_entry, and keeps tracking only the ones that are still non zero after it
+	size_t num_used = 0;
+	for (uint32_t tlb_idx : cpu->tlb_used) {
+		uint32_t &tlb_entry = cpu->cpu_ctx.tlb[tlb_idx];
+		tlb_entry = flush_entry(tlb_entry);
+		if (tlb_entry) {
+			cpu->tlb_used[num_used++] = tlb_idx;
+		}
+		else {
+			cpu->tlb_used_map.reset(tlb_idx);
+		}
+	}
+	cpu->tlb_used.resize(num_used);
+}
+
+void
+tlb_flush(cpu_t *cpu, int n)
+{
+	// The flushes only visit the entries in tlb_used instead of all TLB_MAX_SIZE of them, which would be 4 MiB of writes for every cr3 reload. The only
+	// entries that can be non zero without being tracked are the ones where the jitted code of mov drN sets TLB_WATCH. These are already flushed for
+	// TLB_keep_cw and TLB_no_g, and TLB_zero rewrites them below from the current watchpoints
 	switch (n)
 	{
 	case TLB_zero: {
@@ -176,30 +373,26 @@ tlb_flush(cpu_t *cpu, int n)
 				}
 			}
 		}
-		for (uint32_t &tlb_entry : cpu->cpu_ctx.tlb) {
-			tlb_entry = 0;
-		}
+		tlb_flush_used(cpu, [](uint32_t) -> uint32_t { return 0; });
 		for (int idx = 0; idx < 4; ++idx) {
 			if (mem_watch[idx]) {
-				cpu->cpu_ctx.tlb[tlb_watch_idx[idx * 2]] = tlb_watch[idx * 2];
-				cpu->cpu_ctx.tlb[tlb_watch_idx[idx * 2 + 1]] = tlb_watch[idx * 2 + 1];
+				for (int i = 0; i < 2; ++i) {
+					cpu->cpu_ctx.tlb[tlb_watch_idx[idx * 2 + i]] = tlb_watch[idx * 2 + i];
+					if (tlb_watch[idx * 2 + i]) {
+						tlb_track(cpu, tlb_watch_idx[idx * 2 + i]);
+					}
+				}
 			}
 		}
 	}
 	break;
 
 	case TLB_keep_cw:
-		for (uint32_t &tlb_entry : cpu->cpu_ctx.tlb) {
-			tlb_entry = (tlb_entry & (TLB_CODE | TLB_WATCH));
-		}
+		tlb_flush_used(cpu, [](uint32_t tlb_entry) { return tlb_entry & (TLB_CODE | TLB_WATCH); });
 		break;
 
 	case TLB_no_g:
-		for (uint32_t &tlb_entry : cpu->cpu_ctx.tlb) {
-			if (!(tlb_entry & TLB_GLOBAL)) {
-				tlb_entry = (tlb_entry & (TLB_CODE | TLB_WATCH));
-			}
-		}
+		tlb_flush_used(cpu, [](uint32_t tlb_entry) { return (tlb_entry & TLB_GLOBAL) ? tlb_entry : (tlb_entry & (TLB_CODE | TLB_WATCH)); });
 		break;
 
 	default:
@@ -207,7 +400,11 @@ tlb_flush(cpu_t *cpu, int n)
 	}
 
 	cpu->subpages.clear();
+	pde_cache_flush(cpu);
+	// the rsb is probed without checking the page of the ret, so its entries must not outlive the mappings they were pushed with
+	std::fill(std::begin(cpu->cpu_ctx.rsb), std::end(cpu->cpu_ctx.rsb), ibtc_entry_t());
 }
+#endif
 
 int8_t
 check_page_access(cpu_t *cpu, uint8_t access_level, uint8_t mem_access)
@@ -305,6 +502,20 @@ mmu_raise_page_fault(cpu_t *cpu, addr_t addr, uint32_t eip, disas_ctx_t *disas_c
 	}
 }
 
+static uint8_t *
+pt_host_ptr(cpu_t *cpu, addr_t pt_addr)
+{
+	// returns the host address of the page table at pt_addr if it's entirely in ram. An alias region could end in the middle of the page table, so
+	// this also checks the region before it's resolved by correct_phys_addr
+	const memory_region_t<addr_t> *pt_region = as_memory_search_addr(cpu, pt_addr);
+	if ((pt_addr < pt_region->start) || ((pt_addr + PAGE_MASK) > pt_region->end)) {
+		return nullptr;
+	}
+
+	pt_addr = correct_phys_addr(cpu, pt_addr, pt_region);
+	return ram_host_ptr(cpu, pt_addr, PAGE_SIZE, pt_region);
+}
+
 // NOTE: flags: bit 0 -> is_write, bit 1 -> is_priv, bit 4 -> is_code
 template<bool raise_host_exp = true>
 addr_t mmu_translate_addr(cpu_t *cpu, addr_t addr, uint8_t flags, uint32_t eip, disas_ctx_t *disas_ctx = nullptr)
@@ -322,9 +533,19 @@ addr_t mmu_translate_addr(cpu_t *cpu, addr_t addr, uint8_t flags, uint32_t eip,
 		uint8_t err_code = 0;
 		uint8_t cpu_lv = cpl_to_page_priv[cpu->cpu_ctx.hflags & HFLG_CPL];
 		addr_t pde_addr = (cpu->cpu_ctx.regs.cr3 & CR3_PD_MASK) | (addr >> PAGE_SHIFT_LARGE) * 4;
-		const memory_region_t<addr_t> *pde_region = as_memory_search_addr(cpu, pde_addr);
-		pde_addr = correct_phys_addr(cpu, pde_addr, pde_region);
-		uint32_t pde = as_memory_dispatch_read<uint32_t>(cpu, pde_addr, pde_region);
+		const memory_region_t<addr_t> *pde_region = nullptr;
+		pde_cache_t &pde_cache = cpu->pde_cache[addr >> PAGE_SHIFT_LARGE];
+		if ((pde_cache.gen != cpu->pde_cache_gen) || (pde_cache.pde_ptr == nullptr)) {
+			pde_region = as_memory_search_addr(cpu, pde_addr);
+			pde_addr = correct_phys_addr(cpu, pde_addr, pde_region);
+			if (pde_cache.gen != cpu->pde_cache_gen) {
+				pde_cache.gen = cpu->pde_cache_gen;
+				pde_cache.pde_ptr = ram_host_ptr(cpu, pde_addr, sizeof(uint32_t), pde_region);
+				pde_cache.pt_ptr = nullptr;
+			}
+		}
+		uint8_t *pde_ptr = pde_cache.pde_ptr;
+		uint32_t pde = pde_ptr ? ram_read<uint32_t>(cpu, pde_ptr) : as_memory_dispatch_read<uint32_t>(cpu, pde_addr, pde_region);
 
 		if (!(pde & PTE_PRESENT)) {
 			mmu_raise_page_fault<raise_host_exp>(cpu, addr, eip, disas_ctx, err_code, is_write, cpu_lv);
@@ -340,21 +561,36 @@ addr_t mmu_translate_addr(cpu_t *cpu, addr_t addr, uint8_t flags, uint32_t eip,
 					if (is_write) {
 						pde |= PTE_DIRTY;
 					}
-					as_memory_dispatch_write<uint32_t>(cpu, pde_addr, pde, pde_region);
+					if (pde_ptr) {
+						ram_write<uint32_t>(cpu, pde_ptr, pde);
+					}
+					else {
+						as_memory_dispatch_write<uint32_t>(cpu, pde_addr, pde, pde_region);
+					}
 				}
-				return tlb_fill(cpu, addr, (pde & PTE_ADDR_4M) | (addr & PAGE_MASK_LARGE),
-					tlb_gen_access_mask(cpu, pde_priv & PTE_USER, pde_priv & PTE_WRITE)
-					| is_code | (is_write << 9) | ((pde & PTE_GLOBAL) & ((cpu->cpu_ctx.regs.cr4 & CR4_PGE_MASK) << 1)));
+				uint32_t prot = tlb_gen_access_mask(cpu, pde_priv & PTE_USER, pde_priv & PTE_WRITE)
+					| ((pde & PTE_GLOBAL) & ((cpu->cpu_ctx.regs.cr4 & CR4_PGE_MASK) << 1));
+				return tlb_fill_large(cpu, addr, (pde & PTE_ADDR_4M) | (addr & PAGE_MASK_LARGE), prot | is_code | (is_write << 9),
+					prot | ((pde & PTE_DIRTY) << 3));
 			}
 			err_code = 1;
 			mmu_raise_page_fault<raise_host_exp>(cpu, addr, eip, disas_ctx, err_code, is_write, cpu_lv);
 			return 0;
 		}
 
+		// the page table can change without a tlb flush when the guest writes to the pde, so its address is checked again on every walk
+		if ((pde_cache.pt_ptr == nullptr) || (pde_cache.pt_addr != (pde & PTE_ADDR_4K))) {
+			pde_cache.pt_addr = pde & PTE_ADDR_4K;
+			pde_cache.pt_ptr = pt_host_ptr(cpu, pde_cache.pt_addr);
+		}
 		addr_t pte_addr = (pde & PTE_ADDR_4K) | ((addr >> PAGE_SHIFT) & 0x3FF) * 4;
-		const memory_region_t<addr_t> *pte_region = as_memory_search_addr(cpu, pte_addr);
-		pte_addr = correct_phys_addr(cpu, pte_addr, pte_region);
-		uint32_t pte = as_memory_dispatch_read<uint32_t>(cpu, pte_addr, pte_region);
+		const memory_region_t<addr_t> *pte_region = nullptr;
+		uint8_t *pte_ptr = pde_cache.pt_ptr ? pde_cache.pt_ptr + (pte_addr & PAGE_MASK) : nullptr;
+		if (pte_ptr == nullptr) {
+			pte_region = as_memory_search_addr(cpu, pte_addr);
+			pte_addr = correct_phys_addr(cpu, pte_addr, pte_region);
+		}
+		uint32_t pte = pte_ptr ? ram_read<uint32_t>(cpu, pte_ptr) : as_memory_dispatch_read<uint32_t>(cpu, pte_addr, pte_region);
 
 		if (!(pte & PTE_PRESENT)) {
 			mmu_raise_page_fault<raise_host_exp>(cpu, addr, eip, disas_ctx, err_code, is_write, cpu_lv);
@@ -367,14 +603,24 @@ addr_t mmu_translate_addr(cpu_t *cpu, addr_t addr, uint8_t flags, uint32_t eip,
 				// NOTE: pdes that map page tables do not use the dirty bit. Also note that we must check this here because, if a pde is valid but the pte is not,
 				// a page fault will occur and the accessed bit should not be set
 				pde |= PTE_ACCESSED;
-				as_memory_dispatch_write<uint32_t>(cpu, pde_addr, pde, pde_region);
+				if (pde_ptr) {
+					ram_write<uint32_t>(cpu, pde_ptr, pde);
+				}
+				else {
+					as_memory_dispatch_write<uint32_t>(cpu, pde_addr, pde, pde_region);
+				}
 			}
 			if (!(pte & PTE_ACCESSED) || is_write) {
 				pte |= PTE_ACCESSED;
 				if (is_write) {
 					pte |= PTE_DIRTY;
 				}
-				as_memory_dispatch_write<uint32_t>(cpu, pte_addr, pte, pte_region);
+				if (pte_ptr) {
+					ram_write<uint32_t>(cpu, pte_ptr, pte);
+				}
+				else {
+					as_memory_dispatch_write<uint32_t>(cpu, pte_addr, pte, pte_region);
+				}
 			}
 			return tlb_fill(cpu, addr, (pte & PTE_ADDR_4K) | (addr & PAGE_MASK),
 				tlb_gen_access_mask(cpu, access_lv & PTE_USER, access_lv & PTE_WRITE)
@@ -393,10 +639,10 @@ get_phys_addr(cpu_t *cpu, addr_t addr, uint32_t tlb_entry)
 	switch (tlb_entry & (TLB_RAM | TLB_ROM | TLB_MMIO | TLB_SUBPAGE))
 	{
 	case TLB_RAM:
+	case TLB_ROM:
 	default:
 		return (tlb_entry & ~PAGE_MASK) | (addr & PAGE_MASK);
 
-	case TLB_ROM:
 	case TLB_MMIO:
 	case TLB_SUBPAGE:
 		return (cpu->subpages[tlb_entry >> PAGE_SHIFT].phys_addr) | (addr & PAGE_MASK);
@@ -408,7 +654,7 @@ get_phys_addr(cpu_t *cpu, addr_t addr, uint32_t tlb_entry)
 addr_t
 get_read_addr(cpu_t *cpu, addr_t addr, uint8_t is_priv, uint32_t eip)
 {
-	uint32_t tlb_entry = cpu->cpu_ctx.tlb[addr >> PAGE_SHIFT];
+	uint32_t tlb_entry = tlb_read(cpu, addr >> PAGE_SHIFT);
 	if ((tlb_entry & (tlb_access[0][(cpu->cpu_ctx.hflags & HFLG_CPL) >> is_priv])) == 0) {
 		return mmu_translate_addr(cpu, addr, is_priv, eip);
 	}
@@ -422,12 +668,15 @@ get_write_addr(cpu_t *cpu, addr_t addr, uint8_t is_priv, uint32_t eip, uint8_t *
 	// this also needs to check for the dirty flag, to catch the case where the first access to the page is a read and then a write happens, so that
 	// we give the mmu the chance to set the dirty flag in the tlb
 
-	uint32_t tlb_entry = cpu->cpu_ctx.tlb[addr >> PAGE_SHIFT];
-	*is_code = tlb_entry & TLB_CODE;
+	uint32_t tlb_entry = tlb_read(cpu, addr >> PAGE_SHIFT);
 	if (((tlb_access[1][(cpu->cpu_ctx.hflags & HFLG_CPL) >> is_priv]) | TLB_DIRTY) ^ (tlb_entry & ((tlb_access[1][(cpu->cpu_ctx.hflags & HFLG_CPL) >> is_priv]) | TLB_DIRTY))) {
-		return mmu_translate_addr(cpu, addr, 1 | is_priv, eip);
+		// TLB_CODE of a missing entry is only known after the fill, see tlb_code_mask
+		addr_t phys_addr = mmu_translate_addr(cpu, addr, 1 | is_priv, eip);
+		*is_code = tlb_read(cpu, addr >> PAGE_SHIFT) & TLB_CODE;
+		return phys_addr;
 	}
 
+	*is_code = tlb_entry & TLB_CODE;
 	return get_phys_addr(cpu, addr, tlb_entry);
 }
 
@@ -436,12 +685,12 @@ get_code_addr(cpu_t *cpu, addr_t addr, uint32_t eip)
 {
 	// this is only used for ram fetching, so we don't need to check for privileged accesses
 
-	uint32_t tlb_entry = cpu->cpu_ctx.tlb[addr >> PAGE_SHIFT];
+	uint32_t tlb_entry = tlb_read(cpu, addr >> PAGE_SHIFT);
 	if ((tlb_entry & (tlb_access[0][cpu->cpu_ctx.hflags & HFLG_CPL])) == 0) {
 		return mmu_translate_addr(cpu, addr, TLB_CODE, eip);
 	}
 
-	cpu->cpu_ctx.tlb[addr >> PAGE_SHIFT] = tlb_entry | TLB_CODE;
+	tlb_write(cpu, addr >> PAGE_SHIFT) = tlb_entry | TLB_CODE;
 	return get_phys_addr(cpu, addr, tlb_entry);
 }
 
@@ -451,12 +700,12 @@ get_code_addr(cpu_t *cpu, addr_t addr, uint32_t eip, uint32_t is_code, disas_ctx
 	// overloaded get_code_addr that does not throw host exceptions, used in cpu_translate and by the debugger
 	// NOTE: the debugger should not set is_code, since it doesn't execute the instructions
 
-	uint32_t tlb_entry = cpu->cpu_ctx.tlb[addr >> PAGE_SHIFT];
+	uint32_t tlb_entry = tlb_read(cpu, addr >> PAGE_SHIFT);
 	if ((tlb_entry & (tlb_access[0][cpu->cpu_ctx.hflags & HFLG_CPL])) == 0) {
 		return mmu_translate_addr<false>(cpu, addr, is_code, eip, disas_ctx);
 	}
 
-	cpu->cpu_ctx.tlb[addr >> PAGE_SHIFT] = tlb_entry | is_code;
+	tlb_write(cpu, addr >> PAGE_SHIFT) = tlb_entry | is_code;
 	return get_phys_addr(cpu, addr, tlb_entry);
 }
 
@@ -534,7 +783,7 @@ T mem_read_helper(cpu_ctx_t *cpu_ctx, addr_t addr, uint32_t eip, uint8_t is_priv
 {
 	uint32_t tlb_idx1 = addr >> PAGE_SHIFT;
 	uint32_t tlb_idx2 = (addr + sizeof(T) - 1) >> PAGE_SHIFT;
-	uint32_t tlb_entry = cpu_ctx->tlb[tlb_idx1];
+	uint32_t tlb_entry = tlb_read(cpu_ctx->cpu, tlb_idx1);
 	uint32_t mem_access = tlb_access[0][(cpu_ctx->hflags & HFLG_CPL) >> is_priv];
 
 	// interrogate the tlb
@@ -544,22 +793,10 @@ T mem_read_helper(cpu_ctx_t *cpu_ctx, addr_t addr, uint32_t eip, uint8_t is_priv
 		// tlb hit, check the region type
 		switch (tlb_entry & (TLB_RAM | TLB_ROM | TLB_MMIO | TLB_SUBPAGE))
 		{
-		case TLB_RAM: {
-			// it's ram, tlb holds the physical address
-			addr_t phys_addr = (tlb_entry & ~PAGE_MASK) | (addr & PAGE_MASK);
-			T ret = *reinterpret_cast<T *>(&cpu_ctx->ram[phys_addr - cpu_ctx->cpu->ram_start]);
-			if constexpr (is_big_endian) {
-				swap_byte_order<T>(ret);
-			}
-			return ret;
-		}
-
+		case TLB_RAM:
 		case TLB_ROM: {
-			// it's rom, tlb holds the index to find the rom subpage
-			const subpage_t *subpage = &cpu_ctx->cpu->subpages[tlb_entry >> PAGE_SHIFT];
-			addr_t phys_addr = subpage->phys_addr | (addr & PAGE_MASK);
-			const memory_region_t<addr_t> *rom = cpu_ctx->cpu->cached_regions[subpage->cached_region_idx[0]];
-			T ret = *reinterpret_cast<T *>(&rom->rom_ptr[phys_addr - rom->start]);
+			// it's ram or rom, the host address is the host addend of the page plus addr
+			T ret = *reinterpret_cast<T *>(tlb_host_addend(cpu_ctx->cpu, tlb_idx1) + addr);
 			if constexpr (is_big_endian) {
 				swap_byte_order<T>(ret);
 			}
@@ -619,7 +856,7 @@ void mem_write_helper(cpu_ctx_t *cpu_ctx, addr_t addr, T val, uint32_t eip, uint
 {
 	uint32_t tlb_idx1 = addr >> PAGE_SHIFT;
 	uint32_t tlb_idx2 = (addr + sizeof(T) - 1) >> PAGE_SHIFT;
-	uint32_t tlb_entry = cpu_ctx->tlb[tlb_idx1];
+	uint32_t tlb_entry = tlb_read(cpu_ctx->cpu, tlb_idx1);
 	uint32_t mem_access = (tlb_access[1][(cpu_ctx->hflags & HFLG_CPL) >> is_priv]) | TLB_DIRTY;
 
 	// interrogate the tlb
@@ -631,12 +868,11 @@ void mem_write_helper(cpu_ctx_t *cpu_ctx, addr_t addr, T val, uint32_t eip, uint
 		switch (tlb_entry & (TLB_RAM | TLB_ROM | TLB_MMIO | TLB_SUBPAGE))
 		{
 		case TLB_RAM: {
-			// it's ram, access it directly
+			// it's ram, access it directly through the host addend of the page
 			if constexpr (is_big_endian) {
 				swap_byte_order<T>(val);
 			}
-			addr_t phys_addr = (tlb_entry & ~PAGE_MASK) | (addr & PAGE_MASK);
-			*reinterpret_cast<T *>(&cpu_ctx->ram[phys_addr - cpu_ctx->cpu->ram_start]) = val;
+			*reinterpret_cast<T *>(tlb_host_addend(cpu_ctx->cpu, tlb_idx1) + addr) = val;
 			return;
 		}
 
@@ -689,6 +925,19 @@ void mem_write_helper(cpu_ctx_t *cpu_ctx, addr_t addr, T val, uint32_t eip, uint
 		}
 	}
 
+	// writes to a ram page with translated code can still be done here, when they don't touch the granules of the page that hold the code
+	if (((((tlb_entry & (mem_access | TLB_CODE | TLB_WATCH)) | (tlb_idx1 << PAGE_SHIFT)) ^ (mem_access | TLB_CODE | (tlb_idx2 << PAGE_SHIFT))) == 0) &&
+		((tlb_entry & (TLB_RAM | TLB_ROM | TLB_MMIO | TLB_SUBPAGE)) == TLB_RAM)) {
+		addr_t phys_addr = (tlb_entry & ~PAGE_MASK) | (addr & PAGE_MASK);
+		if (!tc_smc_overlaps(cpu_ctx, phys_addr, sizeof(T))) {
+			if constexpr (is_big_endian) {
+				swap_byte_order<T>(val);
+			}
+			*reinterpret_cast<T *>(tlb_host_addend(cpu_ctx->cpu, tlb_idx1) + addr) = val;
+			return;
+		}
+	}
+
 	// tlb miss, acccess the memory region with is_phys flag=0
 	mem_write_slow<T>(cpu_ctx->cpu, addr, val, eip, is_priv);
 }
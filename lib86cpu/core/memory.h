@@ -17,6 +17,12 @@ while (region->aliased_region) { \
 }
 
 void tlb_flush(cpu_t *cpu, int n);
+#ifdef LIB86CPU_COMPACT_TLB
+uint32_t tlb_watch_mask(cpu_t *cpu, uint32_t tlb_idx);
+void tlb_update_watch(cpu_ctx_t *cpu_ctx);
+#else
+void tlb_track(cpu_t *cpu, uint32_t tlb_idx);
+#endif
 inline void *get_rom_host_ptr(const memory_region_t<addr_t> *rom, addr_t addr);
 inline void *get_ram_host_ptr(cpu_t *cpu, addr_t addr);
 addr_t get_read_addr(cpu_t *cpu, addr_t addr, uint8_t is_priv, uint32_t eip);
@@ -38,6 +44,64 @@ inline const uint8_t tlb_access[2][4] = {
 };
 
 
+/*
+ * tlb accessors
+ */
+inline uint32_t
+tlb_read(cpu_t *cpu, uint32_t tlb_idx)
+{
+	// returns the tlb entry of the page tlb_idx. A page that is not in the compact tlb has an invalid entry, with only the TLB_WATCH flag of its page
+#ifdef LIB86CPU_COMPACT_TLB
+	const tlb_slot_t &slot = cpu->cpu_ctx.tlb[tlb_idx & (TLB_NUM_SLOTS - 1)];
+	return (slot.tag == (tlb_idx << PAGE_SHIFT)) ? slot.entry : tlb_watch_mask(cpu, tlb_idx);
+#else
+	return cpu->cpu_ctx.tlb[tlb_idx];
+#endif
+}
+
+inline uint32_t &
+tlb_write(cpu_t *cpu, uint32_t tlb_idx)
+{
+	// returns the tlb entry of the page tlb_idx to be updated. With the compact tlb, this evicts the page that was in the slot of tlb_idx
+#ifdef LIB86CPU_COMPACT_TLB
+	tlb_slot_t &slot = cpu->cpu_ctx.tlb[tlb_idx & (TLB_NUM_SLOTS - 1)];
+	if (slot.tag != (tlb_idx << PAGE_SHIFT)) {
+		slot.tag = tlb_idx << PAGE_SHIFT;
+		slot.entry = tlb_watch_mask(cpu, tlb_idx);
+	}
+	return slot.entry;
+#else
+	tlb_track(cpu, tlb_idx);
+	return cpu->cpu_ctx.tlb[tlb_idx];
+#endif
+}
+
+inline uintptr_t &
+tlb_host_addend(cpu_t *cpu, uint32_t tlb_idx)
+{
+	// returns the host addend of the page tlb_idx, which is only valid when the page is in the tlb and its entry has TLB_RAM or TLB_ROM
+#ifdef LIB86CPU_COMPACT_TLB
+	return cpu->cpu_ctx.tlb_addend[tlb_idx & (TLB_NUM_SLOTS - 1)];
+#else
+	return cpu->cpu_ctx.tlb_addend[tlb_idx];
+#endif
+}
+
+inline void
+tlb_clear(cpu_t *cpu, uint32_t tlb_idx, uint32_t flags)
+{
+	// clears flags in the tlb entry of the page tlb_idx, without adding the page to the compact tlb when it's not there
+#ifdef LIB86CPU_COMPACT_TLB
+	tlb_slot_t &slot = cpu->cpu_ctx.tlb[tlb_idx & (TLB_NUM_SLOTS - 1)];
+	if (slot.tag == (tlb_idx << PAGE_SHIFT)) {
+		slot.entry &= ~flags;
+	}
+#else
+	cpu->cpu_ctx.tlb[tlb_idx] &= ~flags;
+#endif
+}
+
+
 /*
  * address space helpers
  */
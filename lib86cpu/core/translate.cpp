@@ -17,6 +17,21 @@
 
 #define BAD LIB86CPU_ABORT_msg("Encountered unimplemented instruction %s", log_instr(disas_ctx->virt_pc - cpu->instr_bytes, &instr).c_str())
 
+// max number of instrs considered by the flags liveness pass, one bit each in the returned mask
+#define FLAGS_LIVENESS_MAX_INSTR 64
+
+// flags usage of an instr, as seen by the flags liveness pass
+#define FLAGS_USE_OTHER 0 // reads the flags, can raise an exp or can end the tc
+#define FLAGS_USE_NONE  1 // doesn't touch the flags and cannot raise an exp
+#define FLAGS_USE_KILL  2 // overwrites all the flags without reading them and cannot raise an exp
+
+// persistent translation cache file, see tc_file_open
+#define TC_FILE_MAGIC     0x3643544C // "LTC6"
+#define TC_FILE_VERSION   2
+#define TC_FILE_MAX_CODE  (1 << 20) // sanity limit for the size of the code of an entry read from the file
+#define TC_FILE_BATCH     64 // number of entries appended to the file between two flushes, see tc_file_save
+#define TC_FILE_JIT_FLAGS (CPU_DBG_PRESENT | CPU_TRACE_BLOCKS)
+
 
 void
 cpu_reset(cpu_t *cpu)
@@ -374,12 +389,518 @@ translated_code_t::translated_code_t() noexcept
 	size = 0;
 	flags = 0;
 	ptr_code = nullptr;
+	jmp_rel32[0] = jmp_rel32[1] = nullptr;
+	pc2 = 0;
+	code_size = 0;
+	gen = 0;
+	cache_idx = 0;
+	num_exec = 0;
+	referenced = 0;
+	linked_tc = link_prev[0] = link_prev[1] = link_next[0] = link_next[1] = tc_link_t();
+	link_dst[0] = link_dst[1] = nullptr;
+}
+
+static inline uint32_t
+tc_hash(addr_t pc, addr_t cs_base, uint32_t cpu_flags)
+{
+	// mixes all the fields of the tc key with the murmur3 finalizer, so that tc's with the same pc but a different cs_base or cpu_flags don't share the same
+	// probe sequence, and nearby pc's are spread over the whole table
+	uint32_t hash = pc ^ (cs_base * 0x9E3779B1) ^ (cpu_flags * 0x85EBCA77);
+	hash ^= hash >> 16;
+	hash *= 0x85EBCA6B;
+	hash ^= hash >> 13;
+	hash *= 0xC2B2AE35;
+	hash ^= hash >> 16;
+	return hash & (CODE_CACHE_TABLE_SIZE - 1);
+}
+
+static translated_code_t *const tc_tombstone = reinterpret_cast<translated_code_t *>(1);
+
+code_cache_t::code_cache_t()
+{
+	m_arena = std::make_unique<translated_code_t[]>(CODE_CACHE_MAX_SIZE);
+	m_table = std::make_unique<translated_code_t *[]>(CODE_CACHE_TABLE_SIZE);
+	m_free.reserve(CODE_CACHE_MAX_SIZE);
+	for (uint32_t i = CODE_CACHE_MAX_SIZE; i-- > 0;) {
+		m_free.push_back(&m_arena[i]);
+	}
+	std::fill_n(m_table.get(), CODE_CACHE_TABLE_SIZE, nullptr);
+	m_num_used = 0;
+	m_num_tc = 0;
+	m_code_size = 0;
+	m_max_tc = CODE_CACHE_MAX_SIZE - 1;
+	m_max_code_size = std::numeric_limits<size_t>::max();
+	m_gen = 0;
+}
+
+translated_code_t *
+code_cache_t::alloc()
+{
+	// the caller must purge the cache first if it's full
+	assert(!m_free.empty());
+	translated_code_t *tc = m_free.back();
+	m_free.pop_back();
+	return tc;
+}
+
+void
+code_cache_t::release(translated_code_t *tc)
+{
+	*tc = translated_code_t();
+	m_free.push_back(tc);
+}
+
+template<typename F>
+translated_code_t *code_cache_t::search(addr_t pc, addr_t cs_base, uint32_t cpu_flags, F &&is_valid)
+{
+	for (uint32_t idx = tc_hash(pc, cs_base, cpu_flags); m_table[idx] != nullptr; idx = (idx + 1) & (CODE_CACHE_TABLE_SIZE - 1)) {
+		translated_code_t *tc = m_table[idx];
+		if ((tc != tc_tombstone) &&
+			tc->pc == pc &&
+			tc->cs_base == cs_base &&
+			tc->cpu_flags == cpu_flags &&
+			is_valid(tc)) {
+			tc->gen = m_gen;
+			return tc;
+		}
+	}
+
+	return nullptr;
+}
+
+void
+code_cache_t::insert(translated_code_t *tc)
+{
+	// the table is at most half full with cached tc's, so this only triggers when tombstones take up a quarter of it
+	if (m_num_used >= (CODE_CACHE_TABLE_SIZE * 3 / 4)) {
+		rehash();
+	}
+
+	uint32_t idx = tc_hash(tc->pc, tc->cs_base, tc->cpu_flags);
+	while ((m_table[idx] != nullptr) && (m_table[idx] != tc_tombstone)) {
+		idx = (idx + 1) & (CODE_CACHE_TABLE_SIZE - 1);
+	}
+	m_num_used += (m_table[idx] == nullptr);
+	m_table[idx] = tc;
+	tc->cache_idx = idx;
+	m_num_tc++;
+	m_code_size += tc->code_size;
+	tc->gen = ++m_gen;
+}
+
+void
+code_cache_t::erase(translated_code_t *tc)
+{
+	if (m_table[tc->cache_idx] != tc) {
+		LIB86CPU_ABORT_msg("Attempted to erase a tc which is not in the code cache");
+	}
+
+	m_table[tc->cache_idx] = tc_tombstone;
+	m_num_tc--;
+	m_code_size -= tc->code_size;
+}
+
+void
+code_cache_t::clear()
+{
+	for (uint32_t idx = 0; idx < CODE_CACHE_TABLE_SIZE; ++idx) {
+		if ((m_table[idx] != nullptr) && (m_table[idx] != tc_tombstone)) {
+			release(m_table[idx]);
+		}
+		m_table[idx] = nullptr;
+	}
+	m_num_used = 0;
+	m_num_tc = 0;
+	m_code_size = 0;
+}
+
+void
+code_cache_t::rehash()
+{
+	std::vector<translated_code_t *> cached_tc;
+	for (uint32_t idx = 0; idx < CODE_CACHE_TABLE_SIZE; ++idx) {
+		if ((m_table[idx] != nullptr) && (m_table[idx] != tc_tombstone)) {
+			cached_tc.push_back(m_table[idx]);
+		}
+		m_table[idx] = nullptr;
+	}
+	m_num_used = 0;
+	m_num_tc = 0;
+	m_code_size = 0;
+	for (translated_code_t *tc : cached_tc) {
+		uint64_t gen = tc->gen;
+		insert(tc);
+		tc->gen = gen;
+	}
+}
+
+std::vector<translated_code_t *>
+code_cache_t::get_cold_tc()
+{
+	// Returns the least recently used tc's that need to be evicted to bring the cache down to 7/8 of its budget. Evicting more than strictly necessary means
+	// that this only needs to run again after many more tc's have been translated. Most runs of the hot tc's don't go through search, because they are
+	// reached through links, the ibtc or the rsb, so the tc's that ran since the last call are found by their referenced flag and become the most recent ones
+	std::vector<translated_code_t *> cached_tc;
+	cached_tc.reserve(m_num_tc);
+	uint64_t gen = ++m_gen;
+	for (uint32_t idx = 0; idx < CODE_CACHE_TABLE_SIZE; ++idx) {
+		if ((m_table[idx] != nullptr) && (m_table[idx] != tc_tombstone)) {
+			translated_code_t *tc = m_table[idx];
+			if (tc->referenced) {
+				tc->referenced = 0;
+				tc->gen = gen;
+			}
+			cached_tc.push_back(tc);
+		}
+	}
+	std::sort(cached_tc.begin(), cached_tc.end(), [](translated_code_t *lhs, translated_code_t *rhs) {
+		return lhs->gen < rhs->gen;
+		});
+
+	uint32_t num_tc = m_num_tc;
+	size_t code_size = m_code_size;
+	uint32_t max_tc = m_max_tc - (m_max_tc >> 3);
+	size_t max_code_size = m_max_code_size - (m_max_code_size >> 3);
+	size_t num_cold = 0;
+	while ((num_cold < cached_tc.size()) && ((num_tc > max_tc) || (code_size > max_code_size))) {
+		num_tc--;
+		code_size -= cached_tc[num_cold]->code_size;
+		num_cold++;
+	}
+	cached_tc.resize(num_cold);
+
+	return cached_tc;
+}
+
+static inline bool
+tc_crosses_page(translated_code_t *tc)
+{
+	// cpu_translate never continues a tc in the next page, so only its last instr can cross
+	return tc->flags & TC_FLG_PAGE_CROSS;
+}
+
+static bool
+tc_overlaps(translated_code_t *tc, addr_t phys_addr, uint8_t size)
+{
+	// The guest code of a tc that crosses pages is split between the end of the page of pc and the start of the page of pc2, where only the crossing instr
+	// can be. The code of a trace is scattered in the page of pc, so a write anywhere in that page overlaps with it
+	const auto overlaps = [phys_addr, size](addr_t start, uint32_t len) {
+		return len && !(std::min(phys_addr + size - 1, start + len - 1) < std::max(phys_addr, start));
+	};
+
+	if (tc->flags & TC_FLG_TRACE) {
+		if (overlaps(tc->pc & ~PAGE_MASK, PAGE_SIZE)) {
+			return true;
+		}
+	}
+	else if (overlaps(tc->pc, std::min<uint32_t>(tc->size, PAGE_SIZE - (tc->pc & PAGE_MASK)))) {
+		return true;
+	}
+
+	return tc_crosses_page(tc) && overlaps(tc->pc2, X86_MAX_INSTR_LENGTH - 1);
+}
+
+static tc_page_t::range_t
+tc_page_range(translated_code_t *tc, addr_t page)
+{
+	// the code range of the tc in the page, with the same rules of tc_overlaps. Hook tc's have a zero guest code size, so their range is empty
+	if ((tc->pc & ~PAGE_MASK) == page) {
+		uint16_t start = tc->pc & PAGE_MASK;
+		return { start, static_cast<uint16_t>(std::min<uint32_t>(tc->size, PAGE_SIZE - start)), tc };
+	}
+
+	assert(tc_crosses_page(tc) && (tc->pc2 == page));
+	return { 0, X86_MAX_INSTR_LENGTH - 1, tc };
+}
+
+static void
+tc_page_insert(cpu_t *cpu, translated_code_t *tc, addr_t page)
+{
+	tc_page_t &tc_page = cpu->tc_page_map[page >> PAGE_SHIFT];
+	if ((tc->flags & TC_FLG_TRACE) && ((tc->pc & ~PAGE_MASK) == page)) {
+		tc_page.traces.push_back(tc);
+		return;
+	}
+
+	tc_page_t::range_t range = tc_page_range(tc, page);
+	auto it = std::upper_bound(tc_page.ranges.begin(), tc_page.ranges.end(), range.start, [](uint16_t start, const tc_page_t::range_t &elem) {
+		return start < elem.start;
+		});
+	tc_page.ranges.insert(it, range);
+	tc_page.max_len = std::max(tc_page.max_len, range.len);
+}
+
+static void
+tc_page_erase(cpu_t *cpu, translated_code_t *tc, addr_t page)
+{
+	auto it_page = cpu->tc_page_map.find(page >> PAGE_SHIFT);
+	if (it_page == cpu->tc_page_map.end()) {
+		return;
+	}
+
+	tc_page_t &tc_page = it_page->second;
+	if ((tc->flags & TC_FLG_TRACE) && ((tc->pc & ~PAGE_MASK) == page)) {
+		std::erase(tc_page.traces, tc);
+	}
+	else {
+		uint16_t start = tc_page_range(tc, page).start;
+		auto it = std::lower_bound(tc_page.ranges.begin(), tc_page.ranges.end(), start, [](const tc_page_t::range_t &elem, uint16_t start) {
+			return elem.start < start;
+			});
+		while ((it != tc_page.ranges.end()) && (it->start == start)) {
+			if (it->tc == tc) {
+				tc_page.ranges.erase(it);
+				break;
+			}
+			++it;
+		}
+	}
+
+	// max_len is not lowered when a range is erased, because it only needs to be an upper bound
+	if (tc_page.ranges.empty() && tc_page.traces.empty()) {
+		cpu->tc_page_map.erase(it_page);
+	}
+}
+
+template<typename F>
+static void
+tc_page_for_each(const tc_page_t &tc_page, uint32_t first, uint32_t last, F &&f)
+{
+	// calls f for the traces of the page and for the tc's whose code range can overlap with the bytes [first, last] of the page. Ranges that start more
+	// than max_len bytes before first cannot reach it
+	for (translated_code_t *tc : tc_page.traces) {
+		f(tc);
+	}
+
+	uint32_t lowest_start = first > tc_page.max_len ? first - tc_page.max_len : 0;
+	auto it = std::lower_bound(tc_page.ranges.begin(), tc_page.ranges.end(), lowest_start, [](const tc_page_t::range_t &elem, uint32_t start) {
+		return elem.start < start;
+		});
+	for (; (it != tc_page.ranges.end()) && (it->start <= last); ++it) {
+		f(it->tc);
+	}
+}
+
+static uint64_t
+tc_smc_page_mask(translated_code_t *tc, addr_t page)
+{
+	// Returns the granules of the physical page that hold the guest code of the tc, with the same rules of tc_overlaps. The code range is extended backwards
+	// by SMC_MAX_WRITE_SIZE - 1 bytes, so that the jitted code only needs to check the granule of the first byte of a write, see tlb_lookup_code_emit
+	const auto range_mask = [](addr_t start, uint32_t len) -> uint64_t {
+		if (len == 0) {
+			return 0;
+		}
+		uint32_t first = (start & PAGE_MASK) >= (SMC_MAX_WRITE_SIZE - 1) ? ((start & PAGE_MASK) - (SMC_MAX_WRITE_SIZE - 1)) >> SMC_GRANULE_SHIFT : 0;
+		uint32_t last = ((start & PAGE_MASK) + len - 1) >> SMC_GRANULE_SHIFT;
+		return (~0ULL >> (63 - last)) & (~0ULL << first);
+	};
+
+	uint64_t mask = 0;
+	if ((tc->pc & ~PAGE_MASK) == page) {
+		mask = (tc->flags & TC_FLG_TRACE) ? ~0ULL : range_mask(tc->pc, std::min<uint32_t>(tc->size, PAGE_SIZE - (tc->pc & PAGE_MASK)));
+	}
+	if (tc_crosses_page(tc) && (tc->pc2 == page)) {
+		mask |= range_mask(tc->pc2, X86_MAX_INSTR_LENGTH - 1);
+	}
+
+	return mask;
+}
+
+uint64_t *
+tc_smc_page(cpu_t *cpu, addr_t phys_addr)
+{
+	// returns the granules of the page of phys_addr, or nullptr if the page is not in ram. Only ram pages are tracked, because smc is sized by the ram
+	// and the jitted code only writes directly to ram. Pages below the ram wrap around to a big index, so a single compare is enough
+	uint32_t smc_idx = (phys_addr >> PAGE_SHIFT) - cpu->cpu_ctx.smc_first_page;
+	return smc_idx < (cpu->ram_size >> PAGE_SHIFT) ? &cpu->cpu_ctx.smc[smc_idx] : nullptr;
+}
+
+static void
+tc_smc_update_page(cpu_t *cpu, addr_t page)
+{
+	// recalculates the granules of the page from the tc's that are still in it, which clears the ones left behind by erased tc's
+	uint64_t *smc = tc_smc_page(cpu, page);
+	if (smc == nullptr) {
+		return;
+	}
+
+	uint64_t mask = 0;
+	if (auto it_page = cpu->tc_page_map.find(page >> PAGE_SHIFT); it_page != cpu->tc_page_map.end()) {
+		tc_page_for_each(it_page->second, 0, PAGE_MASK, [&mask, page](translated_code_t *tc) {
+			mask |= tc_smc_page_mask(tc, page);
+			});
+	}
+	*smc = mask;
+}
+
+bool
+tc_smc_overlaps(cpu_ctx_t *cpu_ctx, addr_t phys_addr, uint32_t size)
+{
+	// The granules of a page can only have stale bits that are set (e.g. after a tc is evicted), and never stale bits that are cleared. So, if no granule
+	// touched by the write is set, the write cannot overlap with any tc. Only the bytes in the page of phys_addr are checked, and pages outside of ram
+	// are not tracked, so they always need to be searched
+	uint64_t *smc = tc_smc_page(cpu_ctx->cpu, phys_addr);
+	if (smc == nullptr) {
+		return true;
+	}
+
+	uint32_t first = (phys_addr & PAGE_MASK) >> SMC_GRANULE_SHIFT;
+	uint32_t last = std::min<uint32_t>((phys_addr & PAGE_MASK) + size - 1, PAGE_MASK) >> SMC_GRANULE_SHIFT;
+	return *smc & (~0ULL >> (63 - last)) & (~0ULL << first);
+}
+
+void
+tc_smc_set_ram_start(cpu_t *cpu, addr_t ram_start)
+{
+	// smc is indexed from the start of ram, so when the ram is moved the granules are calculated again for the pages that have tc's at their new index
+	cpu->ram_start = ram_start;
+	cpu->cpu_ctx.smc_first_page = ram_start >> PAGE_SHIFT;
+	std::fill_n(cpu->cpu_ctx.smc, cpu->ram_size >> PAGE_SHIFT, 0);
+	for (const auto &[page_idx, tc_page] : cpu->tc_page_map) {
+		tc_smc_update_page(cpu, page_idx << PAGE_SHIFT);
+	}
 }
 
 static inline uint32_t
-tc_hash(addr_t pc)
+ibtc_hash(addr_t pc)
+{
+	// NOTE: this must be kept in sync with the hash calculated by link_indirect_emit
+	return pc & (IBTC_MAX_SIZE - 1);
+}
+
+static void
+ibtc_insert(cpu_t *cpu, translated_code_t *tc)
+{
+	ibtc_entry_t *entry = &cpu->cpu_ctx.ibtc[ibtc_hash(tc->virt_pc)];
+	entry->virt_pc = tc->virt_pc;
+	entry->cs_base = tc->cs_base;
+	entry->cpu_flags = tc->cpu_flags;
+	entry->ptr_code = tc->ptr_code;
+}
+
+static void
+tc_unlink_edge(translated_code_t *tc, uint32_t jmp_idx)
+{
+	// removes the patchable jmp jmp_idx of tc from the incoming list of the tc it's linked to. This doesn't patch the jmp
+	translated_code_t *dst_tc = tc->link_dst[jmp_idx];
+	if (dst_tc == nullptr) {
+		return;
+	}
+
+	tc_link_t prev = tc->link_prev[jmp_idx], next = tc->link_next[jmp_idx];
+	if (prev.tc != nullptr) {
+		prev.tc->link_next[prev.jmp_idx] = next;
+	}
+	else {
+		dst_tc->linked_tc = next;
+	}
+	if (next.tc != nullptr) {
+		next.tc->link_prev[next.jmp_idx] = prev;
+	}
+	tc->link_dst[jmp_idx] = nullptr;
+	tc->link_prev[jmp_idx] = tc->link_next[jmp_idx] = tc_link_t();
+}
+
+static void
+tc_link_edge(cpu_t *cpu, translated_code_t *prev_tc, uint32_t jmp_idx, translated_code_t *ptr_tc)
+{
+	// links the patchable jmp jmp_idx of prev_tc to ptr_tc, and adds it to the head of the incoming list of ptr_tc. An edge that was already linked is
+	// first removed from its old list, so that it's never present twice
+	tc_unlink_edge(prev_tc, jmp_idx);
+	cpu->jit->patch_jmp(prev_tc, jmp_idx, ptr_tc->ptr_code);
+	prev_tc->link_dst[jmp_idx] = ptr_tc;
+	prev_tc->link_next[jmp_idx] = ptr_tc->linked_tc;
+	if (ptr_tc->linked_tc.tc != nullptr) {
+		ptr_tc->linked_tc.tc->link_prev[ptr_tc->linked_tc.jmp_idx] = { prev_tc, jmp_idx };
+	}
+	ptr_tc->linked_tc = { prev_tc, jmp_idx };
+}
+
+static void
+tc_save_links(cpu_t *cpu, translated_code_t *tc)
+{
+	// remembers the edges linked to a hot tc before it's erased, so that tc_restore_links can link them to the tc that replaces it. This tc has the same
+	// key of the hot tc, so it's a valid destination for all of them. Its own edges are skipped, since it won't exist anymore
+	cpu->hot_links.clear();
+	for (tc_link_t link = tc->linked_tc; link.tc != nullptr; link = link.tc->link_next[link.jmp_idx]) {
+		if (link.tc != tc) {
+			cpu->hot_links.push_back(link);
+		}
+	}
+}
+
+static void
+tc_restore_links(cpu_t *cpu, translated_code_t *tc)
+{
+	if (!tc_crosses_page(tc)) {
+		for (const auto &link : cpu->hot_links) {
+			tc_link_edge(cpu, link.tc, link.jmp_idx, tc);
+		}
+	}
+	cpu->hot_links.clear();
+}
+
+static void
+tc_erase(cpu_t *cpu, translated_code_t *tc)
 {
-	return pc & (CODE_CACHE_MAX_SIZE - 1);
+	// Removes a tc from the code cache and from everything else that can reach it, and gives it back to the arena. Its code is only freed later by
+	// tc_free_dead_code, because the tc could still be running (e.g. when it's invalidated by a guest write done by the tc itself)
+
+	// unlink all other tc's which jump to this tc, and remove the edges of this tc from the incoming lists of the tc's it jumps to
+	for (tc_link_t link = tc->linked_tc; link.tc != nullptr;) {
+		translated_code_t *linked_tc = link.tc;
+		uint32_t jmp_idx = link.jmp_idx;
+		link = linked_tc->link_next[jmp_idx];
+		cpu->jit->patch_jmp(linked_tc, jmp_idx, linked_tc->jmp_offset[2]);
+		linked_tc->link_dst[jmp_idx] = nullptr;
+		linked_tc->link_prev[jmp_idx] = linked_tc->link_next[jmp_idx] = tc_link_t();
+	}
+	tc->linked_tc = tc_link_t();
+	tc_unlink_edge(tc, 0);
+	tc_unlink_edge(tc, 1);
+
+	if (auto it_ibtc = cpu->ibtc.find(tc->virt_pc); (it_ibtc != cpu->ibtc.end()) && (it_ibtc->second == tc)) {
+		cpu->ibtc.erase(it_ibtc);
+	}
+	if (ibtc_entry_t *entry = &cpu->cpu_ctx.ibtc[ibtc_hash(tc->virt_pc)]; entry->ptr_code == tc->ptr_code) {
+		*entry = ibtc_entry_t();
+	}
+	for (auto &entry : cpu->cpu_ctx.rsb) {
+		if (entry.ptr_code == tc->ptr_code) {
+			entry = ibtc_entry_t();
+		}
+	}
+
+	// remove the tc from the pages it belongs to. The caller is responsible to clear TLB_CODE of the pages that don't have tc's anymore, if it knows their
+	// virtual address. Otherwise, a stale TLB_CODE only costs a call to tc_invalidate on the next write to the page
+	tc_page_erase(cpu, tc, tc->pc & ~PAGE_MASK);
+	if (tc_crosses_page(tc)) {
+		tc_page_erase(cpu, tc, tc->pc2);
+	}
+
+	cpu->code_cache.erase(tc);
+	cpu->dead_code.push_back(tc->ptr_code);
+	cpu->code_cache.release(tc);
+}
+
+static void
+tc_free_dead_code(cpu_t *cpu)
+{
+	// NOTE: this must only be called when no tc is running, since it frees the code of the erased tc's
+	for (entry_t code : cpu->dead_code) {
+		cpu->jit->free_code_block(reinterpret_cast<void *>(code));
+	}
+	cpu->dead_code.clear();
+}
+
+static void
+tc_cache_evict(cpu_t *cpu)
+{
+	// the evicted tc's could be in hot_links
+	cpu->hot_links.clear();
+	for (translated_code_t *tc : cpu->code_cache.get_cold_tc()) {
+		tc_erase(cpu, tc);
+	}
 }
 
 template<bool remove_hook, bool is_virt>
@@ -416,88 +937,64 @@ void tc_invalidate(cpu_ctx_t *cpu_ctx, addr_t addr, [[maybe_unused]] uint8_t siz
 		}
 	}
 
+	if constexpr (!remove_hook) {
+		// writes that don't touch the parts of the page with translated code don't need to look for the tc's to invalidate
+		if (!tc_smc_overlaps(cpu_ctx, phys_addr, size)) {
+			return;
+		}
+	}
+
 	// find all tc's in the page addr belongs to
 	auto it_map = cpu_ctx->cpu->tc_page_map.find(phys_addr >> PAGE_SHIFT);
 	if (it_map != cpu_ctx->cpu->tc_page_map.end()) {
-		auto it_set = it_map->second.begin();
 		uint32_t flags = (cpu_ctx->hflags & HFLG_CONST) | (cpu_ctx->regs.eflags & EFLAGS_CONST);
-		std::vector<std::unordered_set<translated_code_t *>::iterator> tc_to_delete;
-		// iterate over all tc's found in the page
-		while (it_set != it_map->second.end()) {
-			translated_code_t *tc_in_page = *it_set;
+		// we can't erase the tc's while iterating over the ranges of the page, because tc_erase also removes them from it
+		std::vector<translated_code_t *> tc_to_delete;
+		uint32_t first = phys_addr & PAGE_MASK;
+		uint32_t last = remove_hook ? first : std::min<uint32_t>(first + std::max<uint8_t>(size, 1) - 1, PAGE_MASK);
+		// iterate over the tc's in the page whose code range can include phys_addr
+		tc_page_for_each(it_map->second, first, last, [&](translated_code_t *tc_in_page) {
 			// only invalidate the tc if phys_addr is included in the translated address range of the tc
 			// hook tc's have a zero guest code size, so they are unaffected by guest writes and do not need to be considered by tc_invalidate
 			bool remove_tc;
 			if constexpr (remove_hook) {
-				remove_tc = !tc_in_page->size && (tc_in_page->pc == phys_addr);
+				remove_tc = tc_to_delete.empty() && !tc_in_page->size && (tc_in_page->pc == phys_addr);
 			}
 			else {
-				remove_tc = tc_in_page->size && !(std::min(phys_addr + size - 1, tc_in_page->pc + tc_in_page->size - 1) < std::max(phys_addr, tc_in_page->pc));
+				remove_tc = tc_overlaps(tc_in_page, phys_addr, size);
 			}
 
 			if (remove_tc) {
-				auto it_list = tc_in_page->linked_tc.begin();
-				// now unlink all other tc's which jump to this tc
-				while (it_list != tc_in_page->linked_tc.end()) {
-					if ((*it_list)->jmp_offset[0] == tc_in_page->ptr_code) {
-						(*it_list)->jmp_offset[0] = (*it_list)->jmp_offset[2];
-					}
-					if ((*it_list)->jmp_offset[1] == tc_in_page->ptr_code) {
-						(*it_list)->jmp_offset[1] = (*it_list)->jmp_offset[2];
-					}
-					it_list++;
-				}
-
-				// delete the found tc from the code cache
-				uint32_t idx = tc_hash(tc_in_page->pc);
-				auto it = cpu_ctx->cpu->code_cache[idx].begin();
-				while (it != cpu_ctx->cpu->code_cache[idx].end()) {
-					if (it->get() == tc_in_page) {
-						try {
-							if (it->get()->cs_base == cpu_ctx->regs.cs_hidden.base &&
-								it->get()->pc == get_code_addr(cpu_ctx->cpu, get_pc(cpu_ctx), cpu_ctx->regs.eip) &&
-								it->get()->cpu_flags == flags) {
-								// worst case: the write overlaps with the tc we are currently executing
-								halt_tc = true;
-								if constexpr (!remove_hook) {
-									cpu_ctx->cpu->cpu_flags |= (CPU_DISAS_ONE | CPU_ALLOW_CODE_WRITE);
-								}
-							}
-						}
-						catch (host_exp_t type) {
-							// the current tc cannot fault
+				try {
+					if (tc_in_page->cs_base == cpu_ctx->regs.cs_hidden.base &&
+						tc_in_page->pc == get_code_addr(cpu_ctx->cpu, get_pc(cpu_ctx), cpu_ctx->regs.eip) &&
+						tc_in_page->cpu_flags == flags) {
+						// worst case: the write overlaps with the tc we are currently executing
+						halt_tc = true;
+						if constexpr (!remove_hook) {
+							cpu_ctx->cpu->cpu_flags |= (CPU_DISAS_ONE | CPU_ALLOW_CODE_WRITE);
 						}
-						cpu_ctx->cpu->code_cache[idx].erase(it);
-						cpu_ctx->cpu->num_tc--;
-						break;
 					}
-					it++;
 				}
-
-				// we can't delete the tc in tc_page_map right now because it would invalidate its iterator, which is still needed below
-				tc_to_delete.push_back(it_set);
-
-				if constexpr (remove_hook) {
-					break;
+				catch (host_exp_t type) {
+					// the current tc cannot fault
 				}
-			}
-			it_set++;
-		}
 
-		// delete the found tc's from tc_page_map and ibtc
-		for (auto &it : tc_to_delete) {
-			auto it_ibtc = cpu_ctx->cpu->ibtc.find((*it)->virt_pc);
-			if (it_ibtc != cpu_ctx->cpu->ibtc.end()) {
-				cpu_ctx->cpu->ibtc.erase(it_ibtc);
+				tc_to_delete.push_back(tc_in_page);
 			}
-			it_map->second.erase(it);
-		}
+			});
 
-		// if the tc_page_map for addr is now empty, also clear TLB_CODE and its key in the map
-		if (it_map->second.empty()) {
-			cpu_ctx->tlb[addr >> PAGE_SHIFT] &= ~TLB_CODE;
-			cpu_ctx->cpu->tc_page_map.erase(it_map);
+		// if the tc_page_map for addr becomes empty, also clear TLB_CODE. The key in the map is erased by tc_erase
+		for (translated_code_t *tc : tc_to_delete) {
+			tc_erase(cpu_ctx->cpu, tc);
 		}
+		if (!cpu_ctx->cpu->tc_page_map.contains(phys_addr >> PAGE_SHIFT)) {
+			tlb_clear(cpu_ctx->cpu, addr >> PAGE_SHIFT, TLB_CODE);
+		}
+	}
+
+	if constexpr (!remove_hook) {
+		tc_smc_update_page(cpu_ctx->cpu, phys_addr & ~PAGE_MASK);
 	}
 
 	if (halt_tc) {
@@ -515,37 +1012,44 @@ template void tc_invalidate<false, true>(cpu_ctx_t * cpu_ctx, addr_t addr, [[may
 template void tc_invalidate<false, false>(cpu_ctx_t *cpu_ctx, addr_t addr, [[maybe_unused]] uint8_t size, [[maybe_unused]] uint32_t eip);
 
 static translated_code_t *
-tc_cache_search(cpu_t *cpu, addr_t pc)
+tc_cache_search(cpu_t *cpu, addr_t pc, addr_t virt_pc)
 {
 	uint32_t flags = (cpu->cpu_ctx.hflags & HFLG_CONST) | (cpu->cpu_ctx.regs.eflags & EFLAGS_CONST);
-	uint32_t idx = tc_hash(pc);
-	auto it = cpu->code_cache[idx].begin();
-	while (it != cpu->code_cache[idx].end()) {
-		translated_code_t *tc = it->get();
-		if (tc->cs_base == cpu->cpu_ctx.regs.cs_hidden.base &&
-			tc->pc == pc &&
-			tc->cpu_flags == flags) {
-			return tc;
+	return cpu->code_cache.search(pc, cpu->cpu_ctx.regs.cs_hidden.base, flags, [cpu, virt_pc](translated_code_t *tc) {
+		if (!tc_crosses_page(tc)) {
+			return true;
 		}
-		it++;
-	}
 
-	return nullptr;
+		// the second page of the tc must still be mapped to the same physical page it was translated from. If it faults now instead, we need to translate
+		// the tc again, so that the fault is raised by the crossing instr
+		disas_ctx_t disas_ctx{};
+		addr_t pc2 = get_code_addr(cpu, (virt_pc & ~PAGE_MASK) + PAGE_SIZE, cpu->cpu_ctx.regs.eip, TLB_CODE, &disas_ctx);
+		return (disas_ctx.exp_data.idx != EXP_PF) && ((pc2 & ~PAGE_MASK) == tc->pc2);
+		});
 }
 
 static void
-tc_cache_insert(cpu_t *cpu, addr_t pc, std::unique_ptr<translated_code_t> &&tc)
+tc_cache_insert(cpu_t *cpu, translated_code_t *tc)
 {
-	cpu->num_tc++;
-	cpu->tc_page_map[pc >> PAGE_SHIFT].insert(tc.get());
-	cpu->code_cache[tc_hash(pc)].push_front(std::move(tc));
+	tc_page_insert(cpu, tc, tc->pc & ~PAGE_MASK);
+	if (uint64_t *smc = tc_smc_page(cpu, tc->pc)) {
+		*smc |= tc_smc_page_mask(tc, tc->pc & ~PAGE_MASK);
+	}
+	if (tc_crosses_page(tc)) {
+		tc_page_insert(cpu, tc, tc->pc2);
+		if (uint64_t *smc = tc_smc_page(cpu, tc->pc2)) {
+			*smc |= tc_smc_page_mask(tc, tc->pc2);
+		}
+	}
+	cpu->code_cache.insert(tc);
 }
 
 template<bool should_flush_tlb>
 void tc_should_clear_cache_and_tlb(cpu_t *cpu, addr_t start, addr_t end)
 {
-	for (uint32_t tlb_idx_s = start >> PAGE_SHIFT, tlb_idx_e = end >> PAGE_SHIFT; tlb_idx_s <= tlb_idx_e; ++tlb_idx_s) {
-		if (cpu->cpu_ctx.tlb[tlb_idx_s] & TLB_CODE) {
+	// start and end are physical addresses, so this looks for the tc's in tc_page_map instead of relying on TLB_CODE, which the compact tlb can lose
+	for (uint32_t page_idx_s = start >> PAGE_SHIFT, page_idx_e = end >> PAGE_SHIFT; page_idx_s <= page_idx_e; ++page_idx_s) {
+		if (cpu->tc_page_map.contains(page_idx_s)) {
 			tc_cache_clear(cpu);
 			break;
 		}
@@ -563,12 +1067,17 @@ tc_cache_clear(cpu_t *cpu)
 {
 	// Use this when you want to destroy all tc's but without affecting the actual code allocated. E.g: on x86-64, you'll want to keep the .pdata sections
 	// when this is called from a function called from the JITed code, and the current function can potentially throw an exception
-	cpu->num_tc = 0;
+	for (const auto &[page_idx, tc_page] : cpu->tc_page_map) {
+		if (uint64_t *smc = tc_smc_page(cpu, page_idx << PAGE_SHIFT)) {
+			*smc = 0;
+		}
+	}
 	cpu->tc_page_map.clear();
+	cpu->hot_links.clear();
 	cpu->ibtc.clear();
-	for (auto &bucket : cpu->code_cache) {
-		bucket.clear();
-	}
+	std::fill(std::begin(cpu->cpu_ctx.ibtc), std::end(cpu->cpu_ctx.ibtc), ibtc_entry_t());
+	std::fill(std::begin(cpu->cpu_ctx.rsb), std::end(cpu->cpu_ctx.rsb), ibtc_entry_t());
+	cpu->code_cache.clear();
 }
 
 void
@@ -578,11 +1087,12 @@ tc_cache_purge(cpu_t *cpu)
 	// necessary to unwind the stack of the JITed functions
 	tc_cache_clear(cpu);
 	cpu->jit->destroy_all_code();
+	cpu->dead_code.clear();
 	cpu->jit->gen_int_fn();
 }
 
 static void
-tc_link_direct(translated_code_t *prev_tc, translated_code_t *ptr_tc)
+tc_link_direct(cpu_t *cpu, translated_code_t *prev_tc, translated_code_t *ptr_tc)
 {
 	uint32_t num_jmp = prev_tc->flags & TC_FLG_NUM_JMP;
 
@@ -596,13 +1106,11 @@ tc_link_direct(translated_code_t *prev_tc, translated_code_t *ptr_tc)
 		switch ((prev_tc->flags & TC_FLG_JMP_TAKEN) >> 4)
 		{
 		case TC_JMP_DST_PC:
-			prev_tc->jmp_offset[0] = ptr_tc->ptr_code;
-			ptr_tc->linked_tc.push_front(prev_tc);
+			tc_link_edge(cpu, prev_tc, 0, ptr_tc);
 			break;
 
 		case TC_JMP_NEXT_PC:
-			prev_tc->jmp_offset[1] = ptr_tc->ptr_code;
-			ptr_tc->linked_tc.push_front(prev_tc);
+			tc_link_edge(cpu, prev_tc, 1, ptr_tc);
 			break;
 
 		case TC_JMP_RET:
@@ -622,7 +1130,7 @@ tc_link_direct(translated_code_t *prev_tc, translated_code_t *ptr_tc)
 }
 
 void
-tc_link_dst_only(translated_code_t *prev_tc, translated_code_t *ptr_tc)
+tc_link_dst_only(cpu_t *cpu, translated_code_t *prev_tc, translated_code_t *ptr_tc)
 {
 	switch (prev_tc->flags & TC_FLG_NUM_JMP)
 	{
@@ -630,8 +1138,7 @@ tc_link_dst_only(translated_code_t *prev_tc, translated_code_t *ptr_tc)
 		break;
 
 	case 1:
-		prev_tc->jmp_offset[0] = ptr_tc->ptr_code;
-		ptr_tc->linked_tc.push_front(prev_tc);
+		tc_link_edge(cpu, prev_tc, 0, ptr_tc);
 		break;
 
 	default:
@@ -648,6 +1155,8 @@ link_indirect_handler(cpu_ctx_t *cpu_ctx, translated_code_t *tc)
 		if (it->second->cs_base == cpu_ctx->regs.cs_hidden.base &&
 			it->second->cpu_flags == ((cpu_ctx->hflags & HFLG_CONST) | (cpu_ctx->regs.eflags & EFLAGS_CONST)) &&
 			((it->second->virt_pc & ~PAGE_MASK) == (tc->virt_pc & ~PAGE_MASK))) {
+			// the inline ibtc missed, probably because another tc took the entry, so put this one back
+			ibtc_insert(cpu_ctx->cpu, it->second);
 			return it->second->ptr_code;
 		}
 	}
@@ -655,10 +1164,138 @@ link_indirect_handler(cpu_ctx_t *cpu_ctx, translated_code_t *tc)
 	return tc->jmp_offset[2];
 }
 
+void
+rsb_push_handler(cpu_ctx_t *cpu_ctx, translated_code_t *tc, addr_t ret_pc)
+{
+	// Called by a near call when the ibtc doesn't have the tc at ret_pc, after the call has pushed an empty entry on the rsb. Ret_pc is in the page of tc, so
+	// its physical address is known without a page walk. The tc found is also put in the ibtc, so that the next run of the call can copy it from there.
+	// A tc that crosses pages is never pushed, because only tc_cache_search can validate its second page
+	cpu_t *cpu = cpu_ctx->cpu;
+	translated_code_t *ret_tc = tc_cache_search(cpu, (tc->pc & ~PAGE_MASK) | (ret_pc & PAGE_MASK), ret_pc);
+	if ((ret_tc != nullptr) && !tc_crosses_page(ret_tc)) {
+		cpu->ibtc.insert_or_assign(ret_pc, ret_tc);
+		ibtc_insert(cpu, ret_tc);
+		cpu_ctx->rsb[cpu_ctx->rsb_top] = cpu_ctx->ibtc[ibtc_hash(ret_pc)];
+	}
+}
+
+static uint8_t
+get_instr_flags_use(ZydisDecodedInstruction *instr)
+{
+	// an instr that only accesses gprs (and the flags) cannot raise an exp. Lea has a memory operand, but it only calculates an address with it
+	for (unsigned i = 0; i < instr->operand_count; ++i) {
+		const ZydisDecodedOperand *operand = &instr->operands[i];
+		switch (operand->type)
+		{
+		case ZYDIS_OPERAND_TYPE_REGISTER:
+			switch (ZydisRegisterGetClass(operand->reg.value))
+			{
+			case ZYDIS_REGCLASS_GPR8:
+			case ZYDIS_REGCLASS_GPR16:
+			case ZYDIS_REGCLASS_GPR32:
+			case ZYDIS_REGCLASS_FLAGS:
+				break;
+
+			default:
+				return FLAGS_USE_OTHER;
+			}
+			break;
+
+		case ZYDIS_OPERAND_TYPE_IMMEDIATE:
+			break;
+
+		case ZYDIS_OPERAND_TYPE_MEMORY:
+			if (instr->mnemonic == ZYDIS_MNEMONIC_LEA) {
+				break;
+			}
+			return FLAGS_USE_OTHER;
+
+		default:
+			return FLAGS_USE_OTHER;
+		}
+	}
+
+	switch (instr->mnemonic)
+	{
+	case ZYDIS_MNEMONIC_ADD:
+	case ZYDIS_MNEMONIC_AND:
+	case ZYDIS_MNEMONIC_CMP:
+	case ZYDIS_MNEMONIC_NEG:
+	case ZYDIS_MNEMONIC_OR:
+	case ZYDIS_MNEMONIC_SUB:
+	case ZYDIS_MNEMONIC_TEST:
+	case ZYDIS_MNEMONIC_XOR:
+		return FLAGS_USE_KILL;
+
+	case ZYDIS_MNEMONIC_BSWAP:
+	case ZYDIS_MNEMONIC_LEA:
+	case ZYDIS_MNEMONIC_MOV:
+	case ZYDIS_MNEMONIC_MOVSX:
+	case ZYDIS_MNEMONIC_MOVZX:
+	case ZYDIS_MNEMONIC_NOP:
+	case ZYDIS_MNEMONIC_NOT:
+	case ZYDIS_MNEMONIC_XCHG:
+		return FLAGS_USE_NONE;
+
+	default:
+		return FLAGS_USE_OTHER;
+	}
+}
+
+static uint64_t
+cpu_flags_liveness(cpu_t *cpu, disas_ctx_t *disas_ctx, ZydisDecoder *decoder)
+{
+	// Backward liveness pass over the first instrs of the block. It returns a mask where bit n is set if the lazy eflags produced by the n-th instr of the
+	// block are overwritten by a later instr before anything can observe them. Only the instrs up to the first one that can read the flags, raise an exp or
+	// end the tc are considered, and the flags are always live after the last of them. This means we only need to decode the instrs in the first page of
+	// the block, and with no side effects. Blocks with a single instr and pages with instr breakpoints are skipped, since those observe the flags after every instr.
+	// Tier 0 tc's are skipped too, to keep them fast to translate
+
+	if ((disas_ctx->flags & DISAS_FLG_ONE_INSTR) || (cpu->tc->flags & TC_FLG_TIER0) || (tlb_read(cpu, disas_ctx->virt_pc >> PAGE_SHIFT) & TLB_WATCH)) {
+		return 0;
+	}
+
+	uint8_t instr_buffer[FLAGS_LIVENESS_MAX_INSTR * X86_MAX_INSTR_LENGTH];
+	size_t buffer_size = std::min<size_t>(sizeof(instr_buffer), PAGE_SIZE - (disas_ctx->virt_pc & PAGE_MASK));
+	buffer_size = as_ram_dispatch_read(cpu, disas_ctx->pc, buffer_size, as_memory_search_addr(cpu, disas_ctx->pc), instr_buffer);
+
+	ZydisDecodedInstruction instr;
+	uint8_t flags_use[FLAGS_LIVENESS_MAX_INSTR];
+	unsigned num_instr = 0;
+	size_t offset = 0;
+	while ((num_instr < FLAGS_LIVENESS_MAX_INSTR) && ZYAN_SUCCESS(ZydisDecoderDecodeBuffer(decoder, instr_buffer + offset, buffer_size - offset, &instr))) {
+		offset += instr.length;
+		flags_use[num_instr] = get_instr_flags_use(&instr);
+		if (flags_use[num_instr++] == FLAGS_USE_OTHER) {
+			break;
+		}
+	}
+
+	uint64_t flags_dead = 0;
+	bool flags_live = true;
+	for (unsigned i = num_instr; i-- > 0;) {
+		flags_dead |= static_cast<uint64_t>(!flags_live) << i;
+		switch (flags_use[i])
+		{
+		case FLAGS_USE_KILL:
+			flags_live = false;
+			break;
+
+		case FLAGS_USE_OTHER:
+			flags_live = true;
+			break;
+		}
+	}
+
+	return flags_dead;
+}
+
 static void
 cpu_translate(cpu_t *cpu, disas_ctx_t *disas_ctx)
 {
 	cpu->translate_next = 1;
+	cpu->trace_next = 0;
+	cpu->trace_len = 0;
 	cpu->virt_pc = disas_ctx->virt_pc;
 
 	ZydisDecodedInstruction instr;
@@ -666,6 +1303,7 @@ cpu_translate(cpu_t *cpu, disas_ctx_t *disas_ctx)
 	ZyanStatus status;
 
 	init_instr_decoder(disas_ctx, &decoder);
+	uint64_t flags_dead = cpu_flags_liveness(cpu, disas_ctx, &decoder);
 
 	do {
 		cpu->instr_eip = cpu->virt_pc - cpu->cpu_ctx.regs.cs_hidden.base;
@@ -754,6 +1392,10 @@ cpu_translate(cpu_t *cpu, disas_ctx_t *disas_ctx)
 			cpu->addr_mode = ADDR16;
 		}
 
+		cpu->instr_flags_dead = flags_dead & 1;
+		flags_dead >>= 1;
+		cpu->jit->reg_alloc_instr(&instr);
+
 		switch (instr.mnemonic)
 		{
 		case ZYDIS_MNEMONIC_AAA:
@@ -1255,7 +1897,19 @@ cpu_translate(cpu_t *cpu, disas_ctx_t *disas_ctx)
 		cpu->virt_pc += cpu->instr_bytes;
 		cpu->tc->size += cpu->instr_bytes;
 
-	} while ((cpu->translate_next | (disas_ctx->flags & (DISAS_FLG_PAGE_CROSS | DISAS_FLG_ONE_INSTR))) == 1);
+		if (cpu->trace_next) {
+			// the jit followed a direct jmp/call, so continue decoding at its destination, which is in the same page
+			disas_ctx->pc = (cpu->tc->pc & ~PAGE_MASK) | (cpu->trace_pc & PAGE_MASK);
+			disas_ctx->virt_pc = cpu->trace_pc;
+			cpu->virt_pc = cpu->trace_pc;
+			cpu->trace_next = 0;
+			cpu->tc->flags |= TC_FLG_TRACE;
+			flags_dead = cpu_flags_liveness(cpu, disas_ctx, &decoder);
+		}
+
+		// stop at the end of the page, because disas_ctx->pc is only valid for the page of the first instr. Only an instr that crosses pages can continue
+		// in the next one, and that always ends the tc too
+	} while (((cpu->translate_next | (disas_ctx->flags & (DISAS_FLG_PAGE_CROSS | DISAS_FLG_ONE_INSTR))) == 1) && (disas_ctx->virt_pc & PAGE_MASK));
 }
 
 translated_code_t *
@@ -1284,7 +1938,7 @@ cpu_do_int(cpu_ctx_t *cpu_ctx, uint32_t int_flg)
 							if (auto ram = as_memory_search_addr(cpu, cpu->ram_start); ram->type == mem_type::ram) {
 								cpu->memory_space_tree->erase(ram->start, ram->end);
 							}
-							cpu->ram_start = pair.second->start;
+							tc_smc_set_ram_start(cpu, pair.second->start);
 						}
 						cpu->memory_space_tree->insert(std::move(pair.second));
 					}
@@ -1303,7 +1957,7 @@ cpu_do_int(cpu_ctx_t *cpu_ctx, uint32_t int_flg)
 						if (auto ram = as_memory_search_addr(cpu, cpu->ram_start); ram->type == mem_type::ram) {
 							cpu->memory_space_tree->erase(ram->start, ram->end);
 						}
-						cpu->ram_start = pair.second->start;
+						tc_smc_set_ram_start(cpu, pair.second->start);
 					}
 					cpu->memory_space_tree->insert(std::move(pair.second));
 				}
@@ -1337,6 +1991,286 @@ cpu_do_int(cpu_ctx_t *cpu_ctx, uint32_t int_flg)
 	return nullptr;
 }
 
+template<typename T>
+static void
+tc_file_write(std::ofstream &file, const T &val)
+{
+	file.write(reinterpret_cast<const char *>(&val), sizeof(T));
+}
+
+template<typename T>
+static bool
+tc_file_read(std::ifstream &file, T &val)
+{
+	return static_cast<bool>(file.read(reinterpret_cast<char *>(&val), sizeof(T)));
+}
+
+static void
+tc_file_write_entry(std::ofstream &file, const tc_file_entry_t &entry)
+{
+	tc_file_write(file, entry.pc);
+	tc_file_write(file, entry.virt_pc);
+	tc_file_write(file, entry.cs_base);
+	tc_file_write(file, entry.cpu_flags);
+	tc_file_write(file, entry.flags);
+	tc_file_write(file, entry.jit_flags);
+	tc_file_write(file, entry.size);
+	tc_file_write(file, entry.guest_hash);
+	tc_file_write(file, entry.code_hash);
+	tc_file_write(file, entry.code.code_size);
+	tc_file_write(file, entry.code.jmp_rel32);
+	tc_file_write(file, static_cast<uint32_t>(entry.code.code.size()));
+	tc_file_write(file, static_cast<uint32_t>(entry.code.relocs.size()));
+	file.write(reinterpret_cast<const char *>(entry.code.code.data()), entry.code.code.size());
+	for (const auto &reloc : entry.code.relocs) {
+		tc_file_write(file, reloc.offset);
+		tc_file_write(file, reloc.type);
+		tc_file_write(file, reloc.val);
+	}
+}
+
+static uint64_t
+tc_file_code_hash(const tc_code_t &code)
+{
+	// FNV-1a hash of the host code of an entry and of its relocations, which makes tc_file_read_entry drop the entries that were truncated or corrupted
+	// on disk before load_code_block copies them to executable memory. This is a check against damage, not against tampering: the file is a trusted input
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	auto hash_bytes = [&hash](const void *data, size_t size) {
+		const uint8_t *bytes = static_cast<const uint8_t *>(data);
+		for (size_t i = 0; i < size; ++i) {
+			hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+		}
+	};
+
+	hash_bytes(code.code.data(), code.code.size());
+	hash_bytes(&code.code_size, sizeof(code.code_size));
+	hash_bytes(code.jmp_rel32, sizeof(code.jmp_rel32));
+	for (const auto &reloc : code.relocs) {
+		hash_bytes(&reloc.offset, sizeof(reloc.offset));
+		hash_bytes(&reloc.type, sizeof(reloc.type));
+		hash_bytes(&reloc.val, sizeof(reloc.val));
+	}
+
+	return hash;
+}
+
+static bool
+tc_file_read_entry(std::ifstream &file, tc_file_entry_t &entry)
+{
+	// the entries are validated here, so that a corrupted file can't make load_code_block write outside of the code of the tc
+	uint32_t code_len, num_relocs;
+	if (!tc_file_read(file, entry.pc) || !tc_file_read(file, entry.virt_pc) || !tc_file_read(file, entry.cs_base) || !tc_file_read(file, entry.cpu_flags) ||
+		!tc_file_read(file, entry.flags) || !tc_file_read(file, entry.jit_flags) || !tc_file_read(file, entry.size) || !tc_file_read(file, entry.guest_hash) ||
+		!tc_file_read(file, entry.code_hash) || !tc_file_read(file, entry.code.code_size) || !tc_file_read(file, entry.code.jmp_rel32) || !tc_file_read(file, code_len) || !tc_file_read(file, num_relocs)) {
+		return false;
+	}
+
+	if ((code_len > TC_FILE_MAX_CODE) || (entry.code.code_size > code_len) || (num_relocs > code_len) || (entry.size > PAGE_SIZE)) {
+		return false;
+	}
+
+	for (uint32_t offset : entry.code.jmp_rel32) {
+		if ((offset != TC_CODE_NO_JMP) && ((offset > code_len) || ((code_len - offset) < 4))) {
+			return false;
+		}
+	}
+
+	entry.code.code.resize(code_len);
+	if (!file.read(reinterpret_cast<char *>(entry.code.code.data()), code_len)) {
+		return false;
+	}
+
+	entry.code.relocs.resize(num_relocs);
+	for (auto &reloc : entry.code.relocs) {
+		if (!tc_file_read(file, reloc.offset) || !tc_file_read(file, reloc.type) || !tc_file_read(file, reloc.val)) {
+			return false;
+		}
+
+		uint32_t reloc_size = reloc.type == tc_reloc_t::call ? 4 : 8;
+		if ((reloc.type > tc_reloc_t::lib) || (reloc.offset > code_len) || (reloc.offset < reloc_size)) {
+			return false;
+		}
+	}
+
+	return tc_file_code_hash(entry.code) == entry.code_hash;
+}
+
+static tc_file_entry_t *
+tc_file_find(cpu_t *cpu, addr_t pc, addr_t virt_pc, addr_t cs_base, uint32_t cpu_flags)
+{
+	auto [it, end] = cpu->tc_file_map.equal_range(pc);
+	for (; it != end; ++it) {
+		tc_file_entry_t &entry = it->second;
+		if ((entry.virt_pc == virt_pc) && (entry.cs_base == cs_base) && (entry.cpu_flags == cpu_flags) &&
+			(entry.jit_flags == (cpu->cpu_flags & TC_FILE_JIT_FLAGS))) {
+			return &entry;
+		}
+	}
+
+	return nullptr;
+}
+
+static void
+tc_file_map_insert(cpu_t *cpu, tc_file_entry_t &&entry)
+{
+	// a newer entry replaces the one with the same key, which is how the stale entries are dropped when the file is compacted by tc_file_open
+	auto [it, end] = cpu->tc_file_map.equal_range(entry.pc);
+	for (; it != end; ++it) {
+		const tc_file_entry_t &old_entry = it->second;
+		if ((old_entry.virt_pc == entry.virt_pc) && (old_entry.cs_base == entry.cs_base) && (old_entry.cpu_flags == entry.cpu_flags) &&
+			(old_entry.jit_flags == entry.jit_flags)) {
+			it->second = std::move(entry);
+			return;
+		}
+	}
+
+	cpu->tc_file_map.emplace(entry.pc, std::move(entry));
+}
+
+static uint64_t
+tc_file_hash(cpu_t *cpu, addr_t pc, uint32_t size, uint32_t flags)
+{
+	// FNV-1a hash of the guest code of the tc, with the same rules of tc_overlaps. A trace depends on its whole page. The guest code is read with the same
+	// path used by ram_fetch, so this is what the tc would be translated from now
+	addr_t start = pc, len = size;
+	if (flags & TC_FLG_TRACE) {
+		start = pc & ~PAGE_MASK;
+		len = PAGE_SIZE;
+	}
+
+	uint8_t buff[PAGE_SIZE];
+	size_t bytes_read = len ? as_ram_dispatch_read(cpu, start, len, as_memory_search_addr(cpu, start), buff) : 0;
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	for (size_t i = 0; i < bytes_read; ++i) {
+		hash = (hash ^ buff[i]) * 0x100000001B3ULL;
+	}
+
+	return hash ^ bytes_read;
+}
+
+static bool
+tc_file_is_cacheable(cpu_t *cpu, addr_t virt_pc, uint32_t flags)
+{
+	// Hook tc's call a function of the client, and a trace can follow a jmp to a hooked address, so they can't be reused by another run. Pages with
+	// watchpoints emit extra checks that depend on the current debug regs
+	if (cpu->hook_map.contains(virt_pc) || ((flags & TC_FLG_TRACE) && !cpu->hook_map.empty())) {
+		return false;
+	}
+
+	return !(tlb_read(cpu, virt_pc >> PAGE_SHIFT) & TLB_WATCH);
+}
+
+lc86_status
+tc_file_open(cpu_t *cpu, const char *path)
+{
+	// Opens the persistent translation cache. The tc's in the file are read in tc_file_map, and the file is then rewritten without the duplicated entries,
+	// and kept open so that the tc's translated from now on are appended to it by tc_file_save. The file is ignored when it was written by another build of
+	// the library, because the code of the tc's calls the helpers of the build that generated it
+	cpu->tc_file_map.clear();
+	if (cpu->tc_file.is_open()) {
+		cpu->tc_file.close();
+	}
+
+	if (path == nullptr) {
+		return lc86_status::success;
+	}
+
+	uint64_t lib_id = mem_manager::get_lib_id();
+	if (std::ifstream ifs(path, std::ios_base::in | std::ios_base::binary); ifs.is_open()) {
+		uint32_t magic, version;
+		uint64_t file_lib_id;
+		if (tc_file_read(ifs, magic) && tc_file_read(ifs, version) && tc_file_read(ifs, file_lib_id) &&
+			(magic == TC_FILE_MAGIC) && (version == TC_FILE_VERSION) && (file_lib_id == lib_id)) {
+			tc_file_entry_t entry;
+			while (tc_file_read_entry(ifs, entry)) {
+				tc_file_map_insert(cpu, std::move(entry));
+				entry = tc_file_entry_t();
+			}
+		}
+	}
+
+	cpu->tc_file.open(path, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+	if (!cpu->tc_file.is_open()) {
+		cpu->tc_file_map.clear();
+		return set_last_error(lc86_status::invalid_parameter);
+	}
+
+	tc_file_write(cpu->tc_file, static_cast<uint32_t>(TC_FILE_MAGIC));
+	tc_file_write(cpu->tc_file, static_cast<uint32_t>(TC_FILE_VERSION));
+	tc_file_write(cpu->tc_file, lib_id);
+	for (const auto &[pc, entry] : cpu->tc_file_map) {
+		tc_file_write_entry(cpu->tc_file, entry);
+	}
+	cpu->tc_file.flush();
+	cpu->tc_file_unflushed = 0;
+
+	LOG(log_level::info, "Loaded %zu translated blocks from the translation cache file %s", cpu->tc_file_map.size(), path);
+	return lc86_status::success;
+}
+
+static void
+tc_file_save(cpu_t *cpu, translated_code_t *tc)
+{
+	// Appends the tc that was just generated to the persistent translation cache. This must be called before the jit starts a new session, see get_code_block.
+	// The entries stay in the buffer of the stream, which is only flushed every TC_FILE_BATCH entries and when the file is closed
+	if (!cpu->tc_file.is_open() || tc_crosses_page(tc) || !tc_file_is_cacheable(cpu, tc->virt_pc, tc->flags)) {
+		return;
+	}
+
+	uint32_t flags = tc->flags & ~TC_FLG_JMP_TAKEN;
+	uint64_t guest_hash = tc_file_hash(cpu, tc->pc, tc->size, flags);
+	if (tc_file_entry_t *entry = tc_file_find(cpu, tc->pc, tc->virt_pc, tc->cs_base, tc->cpu_flags);
+		entry && (entry->flags == flags) && (entry->guest_hash == guest_hash)) {
+		return;
+	}
+
+	tc_file_entry_t entry;
+	entry.pc = tc->pc;
+	entry.virt_pc = tc->virt_pc;
+	entry.cs_base = tc->cs_base;
+	entry.cpu_flags = tc->cpu_flags;
+	entry.flags = flags;
+	entry.jit_flags = cpu->cpu_flags & TC_FILE_JIT_FLAGS;
+	entry.size = tc->size;
+	entry.guest_hash = guest_hash;
+	if (!cpu->jit->get_code_block(entry.code)) {
+		return;
+	}
+	entry.code_hash = tc_file_code_hash(entry.code);
+	tc_file_write_entry(cpu->tc_file, entry);
+	if (++cpu->tc_file_unflushed == TC_FILE_BATCH) {
+		cpu->tc_file.flush();
+		cpu->tc_file_unflushed = 0;
+	}
+	tc_file_map_insert(cpu, std::move(entry));
+}
+
+static bool
+tc_file_load(cpu_t *cpu, bool is_hot)
+{
+	// Loads the tc in cpu->tc from the persistent translation cache, if it has it and its guest code didn't change since it was saved. A hot tc must not be
+	// replaced by the tier 0 tc that was saved for it
+	if (cpu->tc_file_map.empty() || (cpu->cpu_flags & (CPU_DISAS_ONE | CPU_SINGLE_STEP))) {
+		return false;
+	}
+
+	translated_code_t *tc = cpu->tc;
+	const tc_file_entry_t *entry = tc_file_find(cpu, tc->pc, tc->virt_pc, tc->cs_base, tc->cpu_flags);
+	if ((entry == nullptr) || (is_hot && (entry->flags & TC_FLG_TIER0)) || !tc_file_is_cacheable(cpu, tc->virt_pc, entry->flags) ||
+		(tc_file_hash(cpu, entry->pc, entry->size, entry->flags) != entry->guest_hash)) {
+		return false;
+	}
+
+	if (!cpu->jit->load_code_block(entry->code)) {
+		return false;
+	}
+
+	tc->flags = entry->flags;
+	tc->size = entry->size;
+	tc->num_exec = TC_HOT_THRESHOLD;
+	return true;
+}
+
 // forward declare for cpu_main_loop
 translated_code_t *tc_run_code(cpu_ctx_t *cpu_ctx, translated_code_t *tc);
 
@@ -1355,6 +2289,7 @@ void cpu_main_loop(cpu_t *cpu, T &&lambda)
 {
 	translated_code_t *prev_tc = nullptr, *ptr_tc = nullptr;
 	addr_t virt_pc, pc;
+	bool is_hot = false;
 
 	// main cpu loop
 	while (lambda()) {
@@ -1388,108 +2323,168 @@ void cpu_main_loop(cpu_t *cpu, T &&lambda)
 		if constexpr (!is_trap) {
 			// if we are executing a trapped instr, we must always emit a new tc to run it and not consider other tc's in the cache. Doing so avoids having to invalidate
 			// the tc in the cache that contains the trapped instr
-			ptr_tc = tc_cache_search(cpu, pc);
+			ptr_tc = tc_cache_search(cpu, pc, virt_pc);
+
+			// a tier 0 tc that became hot returns here from its prologue without running, see gen_prologue_main. It's erased and translated again with the
+			// full tier below, and the edges that were linked to it are linked to the new tc. Its code is only freed later by tc_free_dead_code, so this is
+			// also safe when we are called from a hook
+			if ((ptr_tc != nullptr) && (ptr_tc->flags & TC_FLG_TIER0) && (ptr_tc->num_exec <= 0)) {
+				tc_save_links(cpu, ptr_tc);
+				if (prev_tc == ptr_tc) {
+					prev_tc = nullptr;
+				}
+				tc_erase(cpu, ptr_tc);
+				ptr_tc = nullptr;
+				is_hot = true;
+			}
 		}
 
 		if (ptr_tc == nullptr) {
 
 			// code block for this pc not present, we need to translate new code
-			std::unique_ptr<translated_code_t> tc(new translated_code_t);
-
-			cpu->tc = tc.get();
-			cpu->jit->gen_tc_prologue();
-
-			// prepare the disas ctx
-			disas_ctx_t disas_ctx{};
-			disas_ctx.flags = ((cpu->cpu_ctx.hflags & HFLG_CS32) >> CS32_SHIFT) |
-				((cpu->cpu_ctx.hflags & HFLG_PE_MODE) >> (PE_MODE_SHIFT - 1)) |
-				(cpu->cpu_flags & CPU_DISAS_ONE) |
-				((cpu->cpu_flags & CPU_SINGLE_STEP) >> 3) |
-				((cpu->cpu_ctx.regs.eflags & RF_MASK) >> 9) | // if rf is set, we need to clear it after the first instr executed
-				((cpu->cpu_ctx.regs.eflags & TF_MASK) >> 1); // if tf is set, we need to raise a DB exp after every instruction
-			disas_ctx.virt_pc = virt_pc;
-			disas_ctx.pc = pc;
-
-			if constexpr (is_trap) {
-				// don't take hooks if we are executing a trapped instr. Otherwise, if the trapped instr is also hooked, we will take the hook instead of executing it
-				cpu_translate(cpu, &disas_ctx);
-			}
-			else {
-				const auto it = cpu->hook_map.find(disas_ctx.virt_pc);
-				bool take_hook;
-				if constexpr (is_tramp) {
-					take_hook = (it != cpu->hook_map.end()) && !(cpu->cpu_ctx.hflags & HFLG_TRAMP);
-				}
-				else {
-					take_hook = it != cpu->hook_map.end();
-				}
-
-				if (take_hook) {
-					cpu->instr_eip = disas_ctx.virt_pc - cpu->cpu_ctx.regs.cs_hidden.base;
-					cpu->jit->hook_emit(it->second);
-				}
-				else {
-					// start guest code translation
-					cpu_translate(cpu, &disas_ctx);
+			if constexpr (!is_tramp && !is_trap) {
+				// no tc can be running here, so this is where the code of the erased tc's is freed, and where cold tc's are evicted when the code cache
+				// is over its budget
+				tc_free_dead_code(cpu);
+				if (cpu->code_cache.over_budget()) {
+					tc_cache_evict(cpu);
+					prev_tc = nullptr;
 				}
 			}
+			if (cpu->code_cache.full()) {
+				tc_cache_purge(cpu);
+				prev_tc = nullptr;
+			}
 
-			cpu->jit->gen_tc_epilogue();
-
+			cpu->tc = cpu->code_cache.alloc();
 			cpu->tc->pc = pc;
 			cpu->tc->virt_pc = virt_pc;
 			cpu->tc->cs_base = cpu->cpu_ctx.regs.cs_hidden.base;
 			cpu->tc->cpu_flags = (cpu->cpu_ctx.hflags & HFLG_CONST) | (cpu->cpu_ctx.regs.eflags & EFLAGS_CONST);
-			cpu->jit->gen_code_block();
+			if constexpr (!is_trap) {
+				// with CPU_TIERED_JIT, guest code is first translated by the cheap tier, which is faster to translate, since most of it only runs a few times
+				// during boot and loads. Hooks and trapped instrs always use the full tier
+				if ((cpu->cpu_flags & CPU_TIERED_JIT) && !is_hot && !cpu->hook_map.contains(virt_pc)) {
+					cpu->tc->flags |= TC_FLG_TIER0;
+					cpu->tc->num_exec = TC_HOT_THRESHOLD;
+				}
+			}
+			// a tc saved in the persistent translation cache is loaded instead of being translated again, see tc_file_load
+			bool is_loaded = false;
+			if constexpr (!is_trap) {
+				is_loaded = tc_file_load(cpu, is_hot);
+			}
+			is_hot = false;
 
-			// we are done with code generation for this block, so we null the tc and bb pointers to prevent accidental usage
-			ptr_tc = cpu->tc;
-			cpu->tc = nullptr;
+			if (is_loaded) {
+				ptr_tc = cpu->tc;
+				cpu->tc = nullptr;
+				tc_cache_insert(cpu, ptr_tc);
+				tc_restore_links(cpu, ptr_tc);
+			}
+			else {
+				cpu->jit->gen_tc_prologue();
+
+				// prepare the disas ctx
+				disas_ctx_t disas_ctx{};
+				disas_ctx.flags = ((cpu->cpu_ctx.hflags & HFLG_CS32) >> CS32_SHIFT) |
+					((cpu->cpu_ctx.hflags & HFLG_PE_MODE) >> (PE_MODE_SHIFT - 1)) |
+					(cpu->cpu_flags & CPU_DISAS_ONE) |
+					((cpu->cpu_flags & CPU_SINGLE_STEP) >> 3) |
+					((cpu->cpu_ctx.regs.eflags & RF_MASK) >> 9) | // if rf is set, we need to clear it after the first instr executed
+					((cpu->cpu_ctx.regs.eflags & TF_MASK) >> 1); // if tf is set, we need to raise a DB exp after every instruction
+				disas_ctx.virt_pc = virt_pc;
+				disas_ctx.pc = pc;
+
+				if constexpr (is_trap) {
+					// don't take hooks if we are executing a trapped instr. Otherwise, if the trapped instr is also hooked, we will take the hook instead of executing it
+					cpu_translate(cpu, &disas_ctx);
+				}
+				else {
+					const auto it = cpu->hook_map.find(disas_ctx.virt_pc);
+					bool take_hook;
+					if constexpr (is_tramp) {
+						take_hook = (it != cpu->hook_map.end()) && !(cpu->cpu_ctx.hflags & HFLG_TRAMP);
+					}
+					else {
+						take_hook = it != cpu->hook_map.end();
+					}
 
-			if (disas_ctx.flags & (DISAS_FLG_PAGE_CROSS | DISAS_FLG_ONE_INSTR)) {
-				if (cpu->cpu_flags & CPU_FORCE_INSERT) {
-					if ((cpu->num_tc) == CODE_CACHE_MAX_SIZE) {
-						tc_cache_purge(cpu);
-						prev_tc = nullptr;
+					if (take_hook) {
+						cpu->instr_eip = disas_ctx.virt_pc - cpu->cpu_ctx.regs.cs_hidden.base;
+						cpu->jit->hook_emit(it->second);
+					}
+					else {
+						// start guest code translation
+						cpu_translate(cpu, &disas_ctx);
 					}
-					tc_cache_insert(cpu, pc, std::move(tc));
 				}
 
-				cpu_suppress_trampolines<is_tramp>(cpu);
-				cpu->cpu_flags &= ~(CPU_DISAS_ONE | CPU_ALLOW_CODE_WRITE | CPU_FORCE_INSERT);
-				tc_run_code(&cpu->cpu_ctx, ptr_tc);
-				prev_tc = nullptr;
-				continue;
-			}
-			else {
-				if ((cpu->num_tc) == CODE_CACHE_MAX_SIZE) {
-					tc_cache_purge(cpu);
+				cpu->jit->gen_tc_epilogue();
+				cpu->jit->gen_code_block();
+
+				if ((disas_ctx.flags & (DISAS_FLG_PAGE_CROSS | DISAS_FLG_FAULT)) == DISAS_FLG_PAGE_CROSS) {
+					// this can't fault, since the crossing instr was already fetched from the second page
+					cpu->tc->flags |= TC_FLG_PAGE_CROSS;
+					cpu->tc->pc2 = get_code_addr(cpu, (virt_pc & ~PAGE_MASK) + PAGE_SIZE, cpu->cpu_ctx.regs.eip, TLB_CODE, &disas_ctx) & ~PAGE_MASK;
+				}
+
+				if (!(disas_ctx.flags & (DISAS_FLG_FAULT | DISAS_FLG_ONE_INSTR))) {
+					tc_file_save(cpu, cpu->tc);
+				}
+
+				// we are done with code generation for this block, so we null the tc and bb pointers to prevent accidental usage
+				ptr_tc = cpu->tc;
+				cpu->tc = nullptr;
+
+				// tc's that end with a page crossing instr are cached like all others, but not the ones that raise a fetch/debug fault, or that must only be run once
+				if (disas_ctx.flags & (DISAS_FLG_FAULT | DISAS_FLG_ONE_INSTR)) {
+					bool is_cached = cpu->cpu_flags & CPU_FORCE_INSERT;
+					if (is_cached) {
+						tc_cache_insert(cpu, ptr_tc);
+					}
+
+					cpu_suppress_trampolines<is_tramp>(cpu);
+					cpu->cpu_flags &= ~(CPU_DISAS_ONE | CPU_ALLOW_CODE_WRITE | CPU_FORCE_INSERT);
+					cpu->jit->end_patches();
+					tc_run_code(&cpu->cpu_ctx, ptr_tc);
+					if (!is_cached) {
+						// a tc that is not in the code cache is only owned by us, so give it back to the arena now
+						cpu->dead_code.push_back(ptr_tc->ptr_code);
+						cpu->code_cache.release(ptr_tc);
+					}
+					cpu->hot_links.clear();
 					prev_tc = nullptr;
+					continue;
+				}
+				else {
+					tc_cache_insert(cpu, ptr_tc);
+					tc_restore_links(cpu, ptr_tc);
 				}
-				tc_cache_insert(cpu, pc, std::move(tc));
 			}
 		}
 
 		cpu_suppress_trampolines<is_tramp>(cpu);
 
-		// see if we can link the previous tc with the current one
-		if (prev_tc != nullptr) {
+		// see if we can link the previous tc with the current one. A tc that crosses pages is never linked to, because tc_cache_search must validate its second page
+		if ((prev_tc != nullptr) && !tc_crosses_page(ptr_tc)) {
 			switch (prev_tc->flags & TC_FLG_LINK_MASK)
 			{
 			case 0:
 				break;
 
 			case TC_FLG_DST_ONLY:
-				tc_link_dst_only(prev_tc, ptr_tc);
+				tc_link_dst_only(cpu, prev_tc, ptr_tc);
 				break;
 
 			case TC_FLG_DIRECT:
-				tc_link_direct(prev_tc, ptr_tc);
+				tc_link_direct(cpu, prev_tc, ptr_tc);
 				break;
 
 			case TC_FLG_RET:
 			case TC_FLG_INDIRECT:
 				cpu->ibtc.insert_or_assign(virt_pc, ptr_tc);
+				ibtc_insert(cpu, ptr_tc);
 				break;
 
 			default:
@@ -1497,6 +2492,8 @@ void cpu_main_loop(cpu_t *cpu, T &&lambda)
 			}
 		}
 
+		// the code patched by the links done above, or by the tc's erased since the last run, becomes RX again only here, once per batch of patches
+		cpu->jit->end_patches();
 		prev_tc = tc_run_code(&cpu->cpu_ctx, ptr_tc);
 	}
 }
@@ -1505,8 +2502,8 @@ translated_code_t *
 tc_run_code(cpu_ctx_t *cpu_ctx, translated_code_t *tc)
 {
 	try {
-		// run the translated code
-		return tc->ptr_code(cpu_ctx);
+		// run the translated code. This goes through run_code_fn, which saves the host regs used to cache the guest regs
+		return cpu_ctx->cpu->run_code_fn(cpu_ctx, tc->ptr_code);
 	}
 	catch (host_exp_t type) {
 		switch (type)
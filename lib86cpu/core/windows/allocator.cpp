@@ -40,49 +40,193 @@ get_mem_flags(unsigned flags)
 	return PAGE_NOACCESS;
 }
 
-mem_manager::block_header_t *
-mem_manager::create_pool()
+const uint8_t *
+mem_manager::get_lib_base()
 {
-	block_header_t *start = static_cast<block_header_t *>(VirtualAlloc(NULL, POOL_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
-	if (start == NULL) {
-		return nullptr;
+	// base address of the image of the library, so that pointers to its code and data can be described independently of where it's loaded
+	HMODULE module = nullptr;
+	GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, reinterpret_cast<LPCSTR>(&get_mem_flags), &module);
+	return reinterpret_cast<const uint8_t *>(module);
+}
+
+size_t
+mem_manager::get_lib_size()
+{
+	// size of the image of the library, which bounds the pointers that can be described as offsets from get_lib_base
+	const uint8_t *lib_base = get_lib_base();
+	const IMAGE_NT_HEADERS *nt_hdr = reinterpret_cast<const IMAGE_NT_HEADERS *>(lib_base + reinterpret_cast<const IMAGE_DOS_HEADER *>(lib_base)->e_lfanew);
+	return nt_hdr->OptionalHeader.SizeOfImage;
+}
+
+uint64_t
+mem_manager::get_lib_id()
+{
+	// identifies the build of the library with the time stamp and the size of its image, which change every time it's linked
+	const uint8_t *lib_base = get_lib_base();
+	const IMAGE_NT_HEADERS *nt_hdr = reinterpret_cast<const IMAGE_NT_HEADERS *>(lib_base + reinterpret_cast<const IMAGE_DOS_HEADER *>(lib_base)->e_lfanew);
+	return (static_cast<uint64_t>(nt_hdr->FileHeader.TimeDateStamp) << 32) | nt_hdr->OptionalHeader.SizeOfImage;
+}
+
+mem_manager::mem_manager()
+{
+	arena = reserve_arena();
+	for (uint32_t i = NUM_CHUNKS; i-- > 0;) {
+		chunks[i].is_committed = false;
+		free_chunk(i);
 	}
+	curr_chunk = NUM_CHUNKS;
+	curr_offset = 0;
+}
 
-	block_header_t *addr = start;
-	for (unsigned i = 0; i < BLOCKS_PER_POOL - 1; i++) {
-		addr->next = reinterpret_cast<block_header_t *>(reinterpret_cast<uint8_t *>(addr) + BLOCK_SIZE);
-		addr = addr->next;
+mem_manager::~mem_manager()
+{
+	destroy_all_blocks();
+
+	if (arena) {
+		VirtualFree(arena, 0, MEM_RELEASE);
 	}
+}
 
-	addr->next = nullptr;
-	blocks.emplace_back(start);
-	return start;
+uint8_t *
+mem_manager::reserve_arena()
+{
+	// Try to place the arena within 1.5 GiB of the code of the library first, so that the jitted code can reach the helper functions with a rel32 (this assumes
+	// that the library is smaller than 512 MiB). Otherwise, let the os choose where to put it, and the helpers will be called through a register instead
+	static constexpr uintptr_t step = 64 * 1024 * 1024;
+	uintptr_t lib_addr = reinterpret_cast<uintptr_t>(&get_mem_flags) & ~(step - 1);
+	for (uintptr_t offset = step; offset <= (1ULL << 30); offset += step) {
+		if (lib_addr > (offset + ARENA_SIZE)) {
+			if (void *addr = VirtualAlloc(reinterpret_cast<void *>(lib_addr - offset - ARENA_SIZE), ARENA_SIZE, MEM_RESERVE, PAGE_NOACCESS)) {
+				return static_cast<uint8_t *>(addr);
+			}
+		}
+		if (void *addr = VirtualAlloc(reinterpret_cast<void *>(lib_addr + offset), ARENA_SIZE, MEM_RESERVE, PAGE_NOACCESS)) {
+			return static_cast<uint8_t *>(addr);
+		}
+	}
+
+	return static_cast<uint8_t *>(VirtualAlloc(NULL, ARENA_SIZE, MEM_RESERVE, PAGE_NOACCESS));
 }
 
-void *
-mem_manager::alloc()
+bool
+mem_manager::open_chunk()
 {
-	if (head == nullptr) {
-		head = create_pool();
-		if (head == nullptr) {
-			return nullptr;
+	if ((arena == nullptr) || free_chunks.empty()) {
+		return false;
+	}
+
+	uint32_t chunk_idx = free_chunks.back();
+	uint8_t *addr = arena + static_cast<size_t>(chunk_idx) * CHUNK_SIZE;
+	if (chunks[chunk_idx].is_committed) {
+		DWORD dummy;
+		[[maybe_unused]] auto ret = VirtualProtect(addr, CHUNK_SIZE, PAGE_EXECUTE_READWRITE, &dummy);
+		assert(ret);
+	}
+	else {
+		if (VirtualAlloc(addr, CHUNK_SIZE, MEM_COMMIT, PAGE_EXECUTE_READWRITE) == NULL) {
+			return false;
 		}
+		chunks[chunk_idx].is_committed = true;
 	}
 
-	block_header_t *addr = head;
-	head = head->next;
-	return addr;
+	free_chunks.pop_back();
+	chunks[chunk_idx].is_free = false;
+	curr_chunk = chunk_idx;
+	curr_offset = 0;
+	return true;
 }
 
 void
-mem_manager::free(void *ptr)
+mem_manager::close_chunk()
 {
-	// this is necessary because we mark the code section memory as read-only after the code is written to it
+	// The whole chunk becomes RX with a single call. x86 keeps the instruction cache coherent with the stores done to the code, so flushing it only here is enough,
+	// even though the code of the chunk might have already run
+	uint8_t *addr = arena + static_cast<size_t>(curr_chunk) * CHUNK_SIZE;
+	DWORD dummy;
+	[[maybe_unused]] auto ret = VirtualProtect(addr, CHUNK_SIZE, PAGE_EXECUTE_READ, &dummy);
+	assert(ret);
+	ret = FlushInstructionCache(GetCurrentProcess(), addr, curr_offset);
+	assert(ret);
+
+	if (chunks[curr_chunk].num_blocks == 0) {
+		free_chunk(curr_chunk);
+	}
+	curr_chunk = NUM_CHUNKS;
+}
+
+void
+mem_manager::free_chunk(uint32_t chunk_idx)
+{
+	chunks[chunk_idx].num_blocks = 0;
+	chunks[chunk_idx].is_free = true;
+	// a free chunk gets its protection again when it's reused, so reprotect_patched must leave it alone
+	chunks[chunk_idx].is_patched = false;
+	free_chunks.push_back(chunk_idx);
+}
+
+bool
+mem_manager::is_reachable(const void *addr)
+{
+	// true if addr can be reached with a rel32 from anywhere in the arena
+	if (arena == nullptr) {
+		return false;
+	}
+
+	int64_t disp = static_cast<int64_t>(reinterpret_cast<uintptr_t>(addr) - reinterpret_cast<uintptr_t>(arena));
+	return (disp <= INT32_MAX) && ((disp - ARENA_SIZE) >= INT32_MIN);
+}
+
+mem_block
+mem_manager::allocate_big_block(size_t num_bytes)
+{
+	if (arena == nullptr) {
+		return mem_block();
+	}
+
+	uint32_t num_chunks = static_cast<uint32_t>((num_bytes + CHUNK_SIZE - 1) / CHUNK_SIZE), run_start = 0, run_size = 0;
+	for (uint32_t i = 0; (i < NUM_CHUNKS) && (run_size < num_chunks); ++i) {
+		if (chunks[i].is_free) {
+			if (run_size++ == 0) {
+				run_start = i;
+			}
+		}
+		else {
+			run_size = 0;
+		}
+	}
+
+	if (run_size < num_chunks) {
+		return mem_block();
+	}
+
+	uint8_t *addr = arena + static_cast<size_t>(run_start) * CHUNK_SIZE;
+	size_t block_size = static_cast<size_t>(num_chunks) * CHUNK_SIZE;
+	if (VirtualAlloc(addr, block_size, MEM_COMMIT, PAGE_READWRITE) == NULL) {
+		return mem_block();
+	}
+
+	// committing again the chunks that were already committed doesn't change their protection
 	DWORD dummy;
-	[[maybe_unused]] DWORD ret = VirtualProtect(ptr, BLOCK_SIZE, PAGE_READWRITE, &dummy);
+	[[maybe_unused]] auto ret = VirtualProtect(addr, block_size, PAGE_READWRITE, &dummy);
 	assert(ret);
-	static_cast<block_header_t *>(ptr)->next = head;
-	head = static_cast<block_header_t *>(ptr);
+
+	std::erase_if(free_chunks, [run_start, num_chunks](uint32_t chunk_idx) {
+		return (chunk_idx >= run_start) && (chunk_idx < (run_start + num_chunks));
+		});
+	for (uint32_t i = run_start; i < (run_start + num_chunks); ++i) {
+		chunks[i].is_committed = true;
+		chunks[i].is_free = false;
+	}
+
+	big_blocks.emplace(addr, num_chunks);
+	return mem_block(addr, block_size);
+}
+
+bool
+mem_manager::is_in_curr_chunk(void *addr)
+{
+	uint8_t *chunk_addr = arena + static_cast<size_t>(curr_chunk) * CHUNK_SIZE;
+	return (curr_chunk != NUM_CHUNKS) && (static_cast<uint8_t *>(addr) >= chunk_addr) && (static_cast<uint8_t *>(addr) < (chunk_addr + CHUNK_SIZE));
 }
 
 void
@@ -96,17 +240,15 @@ mem_manager::destroy_all_blocks()
 	eh_frames.clear();
 #endif
 
-	for (auto &addr : blocks) {
-		VirtualFree(addr, 0, MEM_RELEASE);
-	}
+	big_blocks.clear();
 
-	for (auto &block : big_blocks) {
-		VirtualFree(block.first, 0, MEM_RELEASE);
+	// all the chunks become free, but they stay committed so that they can be reused without committing them again
+	free_chunks.clear();
+	for (uint32_t i = NUM_CHUNKS; i-- > 0;) {
+		free_chunk(i);
 	}
-	
-	big_blocks.clear();
-	blocks.clear();
-	head = nullptr;
+	curr_chunk = NUM_CHUNKS;
+	curr_offset = 0;
 }
 
 mem_block
@@ -116,25 +258,25 @@ mem_manager::allocate_sys_mem(size_t num_bytes)
 		return mem_block();
 	}
 
-	if (num_bytes > BLOCK_SIZE) {
-		size_t block_size = (num_bytes + PAGE_MASK) & ~PAGE_MASK;
+	if (num_bytes > CHUNK_SIZE) {
+		return allocate_big_block(num_bytes);
+	}
 
-		void *addr = VirtualAlloc(NULL, block_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
-		if (addr == NULL) {
+	size_t block_size = (num_bytes + CODE_ALIGNMENT - 1) & ~(static_cast<size_t>(CODE_ALIGNMENT) - 1);
+	if ((curr_chunk == NUM_CHUNKS) || ((curr_offset + block_size) > CHUNK_SIZE)) {
+		if (curr_chunk != NUM_CHUNKS) {
+			close_chunk();
+		}
+		if (!open_chunk()) {
 			return mem_block();
 		}
-
-		mem_block block(addr, block_size);
-		big_blocks.emplace(addr, block_size);
-		return block;
 	}
 
-	void *addr = alloc();
-	if (addr == nullptr) {
-		return mem_block();
-	}
+	void *addr = arena + static_cast<size_t>(curr_chunk) * CHUNK_SIZE + curr_offset;
+	curr_offset += block_size;
+	chunks[curr_chunk].num_blocks++;
 
-	return mem_block(addr, BLOCK_SIZE);
+	return mem_block(addr, block_size);
 }
 
 void
@@ -147,6 +289,16 @@ mem_manager::protect_sys_mem(const mem_block &block, unsigned flags)
 		return;
 	}
 
+	if (is_in_curr_chunk(addr)) {
+		// the current chunk is RWX until it's closed
+		return;
+	}
+
+	if (uint32_t chunk_idx = static_cast<uint32_t>((static_cast<uint8_t *>(addr) - arena) / CHUNK_SIZE); (chunk_idx < NUM_CHUNKS) && chunks[chunk_idx].is_patched) {
+		// a patched chunk is RWX until reprotect_patched, which then makes it RX (a block bigger than a chunk never starts in a patched chunk)
+		return;
+	}
+
 	DWORD dummy, prot = get_mem_flags(flags);
 	[[maybe_unused]] auto ret = VirtualProtect(addr, size, prot, &dummy);
 	assert(ret);
@@ -157,6 +309,50 @@ mem_manager::protect_sys_mem(const mem_block &block, unsigned flags)
 	}
 }
 
+void
+mem_manager::unprotect_for_patch(const mem_block &block)
+{
+	// Makes the chunks of the block RWX, so that the code in them can be patched. The chunks stay RWX until reprotect_patched, so that all the patches done
+	// to them in the meantime are free. They also stay executable, because the code can be patched while it's running
+	if ((block.addr == nullptr) || (block.size == 0)) {
+		return;
+	}
+
+	uint32_t first_chunk = static_cast<uint32_t>((static_cast<uint8_t *>(block.addr) - arena) / CHUNK_SIZE);
+	uint32_t last_chunk = static_cast<uint32_t>((static_cast<uint8_t *>(block.addr) + block.size - 1 - arena) / CHUNK_SIZE);
+	for (uint32_t chunk_idx = first_chunk; chunk_idx <= last_chunk; ++chunk_idx) {
+		if ((chunk_idx == curr_chunk) || chunks[chunk_idx].is_patched) {
+			continue;
+		}
+
+		DWORD dummy;
+		[[maybe_unused]] auto ret = VirtualProtect(arena + static_cast<size_t>(chunk_idx) * CHUNK_SIZE, CHUNK_SIZE, PAGE_EXECUTE_READWRITE, &dummy);
+		assert(ret);
+		chunks[chunk_idx].is_patched = true;
+		patched_chunks.push_back(chunk_idx);
+	}
+}
+
+void
+mem_manager::reprotect_patched()
+{
+	// makes RX again the chunks patched since the last call. The current chunk is skipped, since it's RWX until it's closed
+	for (uint32_t chunk_idx : patched_chunks) {
+		if (!chunks[chunk_idx].is_patched || (chunk_idx == curr_chunk)) {
+			continue;
+		}
+
+		uint8_t *addr = arena + static_cast<size_t>(chunk_idx) * CHUNK_SIZE;
+		DWORD dummy;
+		[[maybe_unused]] auto ret = VirtualProtect(addr, CHUNK_SIZE, PAGE_EXECUTE_READ, &dummy);
+		assert(ret);
+		ret = FlushInstructionCache(GetCurrentProcess(), addr, CHUNK_SIZE);
+		assert(ret);
+		chunks[chunk_idx].is_patched = false;
+	}
+	patched_chunks.clear();
+}
+
 void
 mem_manager::release_sys_mem(void *addr)
 {
@@ -173,11 +369,18 @@ mem_manager::release_sys_mem(void *addr)
 #endif
 	
 	if (auto it = big_blocks.find(addr); it != big_blocks.end()) {
-		[[maybe_unused]] auto ret = VirtualFree(it->first, 0, MEM_RELEASE);
-		assert(ret);
-		big_blocks.erase(addr);
+		uint32_t chunk_idx = static_cast<uint32_t>((static_cast<uint8_t *>(addr) - arena) / CHUNK_SIZE);
+		for (uint32_t i = chunk_idx; i < (chunk_idx + it->second); ++i) {
+			free_chunk(i);
+		}
+		big_blocks.erase(it);
 		return;
 	}
 
-	free(addr);
+	// the chunk can be reused when all of its blocks are released, unless we are still allocating from it
+	uint32_t chunk_idx = static_cast<uint32_t>((static_cast<uint8_t *>(addr) - arena) / CHUNK_SIZE);
+	assert(chunks[chunk_idx].num_blocks != 0);
+	if ((--chunks[chunk_idx].num_blocks == 0) && (chunk_idx != curr_chunk)) {
+		free_chunk(chunk_idx);
+	}
 }
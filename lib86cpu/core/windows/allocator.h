@@ -9,9 +9,10 @@
 #include <vector>
 #include <map>
 
-#define POOL_SIZE        (64 * 1024)             // 64 KiB
-#define BLOCK_SIZE       (4 * 1024)              // 4 KiB
-#define BLOCKS_PER_POOL  POOL_SIZE / BLOCK_SIZE  // 16
+#define ARENA_SIZE       (512 * 1024 * 1024)     // 512 MiB
+#define CHUNK_SIZE       (256 * 1024)            // 256 KiB
+#define NUM_CHUNKS       (ARENA_SIZE / CHUNK_SIZE)
+#define CODE_ALIGNMENT   16
 
 #define MEM_READ  (1 << 0)
 #define MEM_WRITE (1 << 1)
@@ -25,27 +26,49 @@ struct mem_block {
 	mem_block(void *addr, size_t size) : addr(addr), size(size) {}
 };
 
+// The jitted code is bump allocated from chunks of a single arena, which is reserved once and placed near the code of the library when possible, so that
+// the jitted code can reach the helper functions with a rel32. The chunk that is currently being filled is RWX, and it only becomes RX when it's full, so
+// that the protection is changed once per chunk instead of once per block. A chunk is reused when all the blocks allocated from it have been released.
+// Blocks bigger than a chunk take a run of contiguous free chunks, so that all the jitted code is always inside the arena. The code of a closed chunk
+// that must be patched makes the whole chunk RWX until reprotect_patched is called, so that a batch of patches changes its protection only twice
 class mem_manager {
 public:
+	mem_manager();
 	mem_block allocate_sys_mem(size_t num_bytes);
 	void protect_sys_mem(const mem_block &block, unsigned flags);
+	void unprotect_for_patch(const mem_block &block);
+	void reprotect_patched();
 	void release_sys_mem(void *addr);
 	void destroy_all_blocks();
-	~mem_manager() { destroy_all_blocks(); }
+	bool is_reachable(const void *addr);
+	static const uint8_t *get_lib_base();
+	static size_t get_lib_size();
+	static uint64_t get_lib_id();
+	~mem_manager();
 
 #if defined(_WIN64)
 	std::map<void *, void *> eh_frames;
 #endif
 
 private:
-	struct block_header_t {
-		block_header_t *next;
+	struct chunk_t {
+		uint32_t num_blocks; // number of blocks allocated from this chunk and not yet released
+		bool is_committed;
+		bool is_free;
+		bool is_patched; // made RWX by unprotect_for_patch, and not yet restored by reprotect_patched
 	};
-	block_header_t *head = nullptr;
-	std::vector<void *> blocks;
-	std::map<void *, size_t> big_blocks;
+	uint8_t *arena;
+	chunk_t chunks[NUM_CHUNKS];
+	std::vector<uint32_t> free_chunks;
+	uint32_t curr_chunk;
+	size_t curr_offset;
+	std::map<void *, size_t> big_blocks; // first address of a big block -> number of chunks it uses
+	std::vector<uint32_t> patched_chunks;
 
-	block_header_t *create_pool();
-	void *alloc();
-	void free(void *ptr);
+	uint8_t *reserve_arena();
+	bool open_chunk();
+	void close_chunk();
+	bool is_in_curr_chunk(void *addr);
+	void free_chunk(uint32_t chunk_idx);
+	mem_block allocate_big_block(size_t num_bytes);
 };
@@ -79,13 +79,47 @@ uint8_t *
 lc86_jit::gen_exception_info(uint8_t *code_ptr, size_t code_size)
 {
 	create_unwind_info();
+	return write_exception_info(code_ptr, code_size, m_unwind_info, sizeof(m_unwind_info));
+}
 
+void
+lc86_jit::gen_run_code_exception_info(uint8_t *code_ptr, size_t code_size)
+{
+	// The prolog of run_code() always uses push rsi, push rdi, push rbp, push r12, push r13, push r14, push r15 and sub rsp, 0x20, so the unwind table
+	// is fixed. The unwind codes are in reverse order of the prolog instructions, and each one holds the offset of the end of its instruction
+
+	static constexpr uint16_t unwind_codes[8] = {
+		15 | (UWOP_ALLOC_SMALL << 8) | ((0x20 / 8 - 1) << 12),
+		11 | (UWOP_PUSH_NONVOL << 8) | (EXP_R15_idx << 12),
+		9 | (UWOP_PUSH_NONVOL << 8) | (EXP_R14_idx << 12),
+		7 | (UWOP_PUSH_NONVOL << 8) | (EXP_R13_idx << 12),
+		5 | (UWOP_PUSH_NONVOL << 8) | (EXP_R12_idx << 12),
+		3 | (UWOP_PUSH_NONVOL << 8) | (EXP_RBP_idx << 12),
+		2 | (UWOP_PUSH_NONVOL << 8) | (EXP_RDI_idx << 12),
+		1 | (UWOP_PUSH_NONVOL << 8) | (EXP_RSI_idx << 12),
+	};
+	assert(get_jit_reg_args_size() == 0x20);
+
+	// Create the UNWIND_INFO table
+	uint8_t unwind_info[4 + sizeof(unwind_codes)];
+	unwind_info[0] = 1 | (0 << 3);      // version and flags
+	unwind_info[1] = 15;                // size of prolog
+	unwind_info[2] = 8;                 // num of unwind codes
+	unwind_info[3] = 0;                 // frame reg and offset
+	std::memcpy(&unwind_info[4], unwind_codes, sizeof(unwind_codes));
+
+	write_exception_info(code_ptr, code_size, unwind_info, sizeof(unwind_info));
+}
+
+uint8_t *
+lc86_jit::write_exception_info(uint8_t *code_ptr, size_t code_size, const uint8_t *unwind_info, size_t unwind_info_size)
+{
 	// Write .xdata
 	size_t aligned_code_size = (code_size + sizeof(DWORD) - 1) & ~(sizeof(DWORD) - 1);
-	std::memcpy(code_ptr + aligned_code_size, m_unwind_info, sizeof(m_unwind_info));
+	std::memcpy(code_ptr + aligned_code_size, unwind_info, unwind_info_size);
 
 	// Write .pdata
-	RUNTIME_FUNCTION *table = reinterpret_cast<RUNTIME_FUNCTION *>(code_ptr + aligned_code_size + sizeof(m_unwind_info));
+	RUNTIME_FUNCTION *table = reinterpret_cast<RUNTIME_FUNCTION *>(code_ptr + aligned_code_size + unwind_info_size);
 	table->BeginAddress = 0;
 	table->EndAddress = code_size;
 	table->UnwindInfoAddress = aligned_code_size;
@@ -325,14 +325,14 @@ dbg_disas_code_block(cpu_t *cpu, disas_ctx_t *disas_ctx, ZydisDecoder *decoder,
 			if ((disas_ctx->virt_pc & ~PAGE_MASK) != ((next_pc - 1) & ~PAGE_MASK)) {
 				// page crossing, needs to translate virt_pc again and disable debug exp in the new page
 				disas_ctx->pc = get_code_addr(cpu, next_pc, disas_ctx->virt_pc - cpu->cpu_ctx.regs.cs_hidden.base, 0, disas_ctx);
-				cpu->cpu_ctx.tlb[disas_ctx->virt_pc >> PAGE_SHIFT] = tlb_entry;
+				tlb_write(cpu, disas_ctx->virt_pc >> PAGE_SHIFT) = tlb_entry;
 				if (disas_ctx->exp_data.idx == EXP_PF) {
 					// page fault in the new page, cannot display remaining instr
 					disas_ctx->virt_pc = next_pc;
 					return disas_data;
 				}
-				tlb_entry = cpu->cpu_ctx.tlb[next_pc >> PAGE_SHIFT];
-				cpu->cpu_ctx.tlb[next_pc >> PAGE_SHIFT] &= ~TLB_WATCH;
+				tlb_entry = tlb_read(cpu, next_pc >> PAGE_SHIFT);
+				tlb_write(cpu, next_pc >> PAGE_SHIFT) &= ~TLB_WATCH;
 			}
 			else {
 				disas_ctx->pc += bytes;
@@ -341,11 +341,11 @@ dbg_disas_code_block(cpu_t *cpu, disas_ctx_t *disas_ctx, ZydisDecoder *decoder,
 		}
 		else {
 			// decoding failed, cannot display remaining instr
-			cpu->cpu_ctx.tlb[disas_ctx->virt_pc >> PAGE_SHIFT] = tlb_entry;
+			tlb_write(cpu, disas_ctx->virt_pc >> PAGE_SHIFT) = tlb_entry;
 			return disas_data;
 		}
 	}
-	cpu->cpu_ctx.tlb[disas_ctx->virt_pc >> PAGE_SHIFT] = tlb_entry;
+	tlb_write(cpu, disas_ctx->virt_pc >> PAGE_SHIFT) = tlb_entry;
 	return disas_data;
 }
 
@@ -364,8 +364,8 @@ dbg_disas_code_block(cpu_t *cpu, addr_t pc, unsigned instr_num)
 	}
 
 	// disable debug exp since we only want to disassemble instr for displying them
-	uint32_t tlb_entry = cpu->cpu_ctx.tlb[disas_ctx.virt_pc >> PAGE_SHIFT];
-	cpu->cpu_ctx.tlb[disas_ctx.virt_pc >> PAGE_SHIFT] &= ~TLB_WATCH;
+	uint32_t tlb_entry = tlb_read(cpu, disas_ctx.virt_pc >> PAGE_SHIFT);
+	tlb_write(cpu, disas_ctx.virt_pc >> PAGE_SHIFT) &= ~TLB_WATCH;
 
 	ZydisDecoder decoder;
 	init_instr_decoder(&disas_ctx, &decoder);
@@ -547,7 +547,7 @@ dbg_insert_sw_breakpoint(cpu_t *cpu, addr_t addr)
 	try {
 		uint8_t is_code;
 		volatile addr_t phys_addr = get_write_addr(cpu, addr, 0, cpu->cpu_ctx.regs.eip, &is_code);
-		if (cpu->cpu_ctx.tlb[addr >> PAGE_SHIFT] & TLB_RAM) {
+		if (tlb_read(cpu, addr >> PAGE_SHIFT) & TLB_RAM) {
 			inserted = true;
 		}
 		else {
@@ -579,15 +579,15 @@ dbg_apply_sw_breakpoints(cpu_t *cpu)
 	for (const auto &elem : break_list) {
 		// disable debug exp since we only want to insert a breakpoint
 		addr_t addr = elem.first;
-		uint32_t tlb_entry = cpu->cpu_ctx.tlb[addr >> PAGE_SHIFT];
-		cpu->cpu_ctx.tlb[addr >> PAGE_SHIFT] &= ~TLB_WATCH;
+		uint32_t tlb_entry = tlb_read(cpu, addr >> PAGE_SHIFT);
+		tlb_write(cpu, addr >> PAGE_SHIFT) &= ~TLB_WATCH;
 
 		// the mem accesses below cannot raise page faults since break_list can only contain valid pages because of the checks done in insert_sw_breakpoint
 		uint8_t original_byte = mem_read<uint8_t>(cpu, addr, cpu->cpu_ctx.regs.eip, 0);
 		mem_write<uint8_t>(cpu, addr, 0xCC, cpu->cpu_ctx.regs.eip, 0);
 		break_list.insert_or_assign(addr, original_byte);
 
-		cpu->cpu_ctx.tlb[addr >> PAGE_SHIFT] = tlb_entry;
+		tlb_write(cpu, addr >> PAGE_SHIFT) = tlb_entry;
 	}
 
 	(cpu->cpu_ctx.hflags &= ~HFLG_CPL) |= old_cpl;
@@ -606,8 +606,8 @@ dbg_remove_sw_breakpoints(cpu_t *cpu)
 	for (const auto &elem : break_list) {
 		// disable debug exp since we only want to remove a breakpoint
 		const auto &[addr, original_byte] = elem;
-		uint32_t tlb_entry = cpu->cpu_ctx.tlb[addr >> PAGE_SHIFT];
-		cpu->cpu_ctx.tlb[addr >> PAGE_SHIFT] &= ~TLB_WATCH;
+		uint32_t tlb_entry = tlb_read(cpu, addr >> PAGE_SHIFT);
+		tlb_write(cpu, addr >> PAGE_SHIFT) &= ~TLB_WATCH;
 
 		try {
 			mem_write<uint8_t>(cpu, addr, original_byte, cpu->cpu_ctx.regs.eip, 0);
@@ -616,7 +616,7 @@ dbg_remove_sw_breakpoints(cpu_t *cpu)
 			// this can only happen when the page is invalid
 		}
 
-		cpu->cpu_ctx.tlb[addr >> PAGE_SHIFT] = tlb_entry;
+		tlb_write(cpu, addr >> PAGE_SHIFT) = tlb_entry;
 	}
 
 	(cpu->cpu_ctx.hflags &= ~HFLG_CPL) |= old_cpl;
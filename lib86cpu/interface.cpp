@@ -144,8 +144,16 @@ cpu_new(size_t ramsize, cpu_t *&out, fp_int int_fn, const char *debuggee)
 		return set_last_error(lc86_status::no_memory);
 	}
 
+	cpu->cpu_ctx.smc = new uint64_t[ramsize >> PAGE_SHIFT]();
+	if (cpu->cpu_ctx.smc == nullptr) {
+		cpu_free(cpu);
+		return set_last_error(lc86_status::no_memory);
+	}
+	cpu->ram_size = ramsize;
+
 	cpu->cpu_name = "Intel Pentium III";
 	cpu_reset(cpu);
+	tlb_flush(cpu, TLB_zero);
 	// XXX: eventually, the user should be able to set the instruction formatting
 	set_instr_format(cpu);
 	cpu->dbg_name = debuggee ? debuggee : "";
@@ -182,8 +190,8 @@ cpu_free(cpu_t *cpu)
 		delete[] cpu->cpu_ctx.ram;
 	}
 
-	for (auto &bucket : cpu->code_cache) {
-		bucket.clear();
+	if (cpu->cpu_ctx.smc) {
+		delete[] cpu->cpu_ctx.smc;
 	}
 
 	delete cpu;
@@ -244,11 +252,11 @@ cpu_sync_state(cpu_t *cpu)
 lc86_status
 cpu_set_flags(cpu_t *cpu, uint32_t flags)
 {
-	if (flags & ~(CPU_INTEL_SYNTAX | CPU_DBG_PRESENT)) {
+	if (flags & ~(CPU_INTEL_SYNTAX | CPU_DBG_PRESENT | CPU_TRACE_BLOCKS | CPU_TIERED_JIT)) {
 		return set_last_error(lc86_status::invalid_parameter);
 	}
 
-	cpu->cpu_flags &= ~(CPU_INTEL_SYNTAX | CPU_DBG_PRESENT);
+	cpu->cpu_flags &= ~(CPU_INTEL_SYNTAX | CPU_DBG_PRESENT | CPU_TRACE_BLOCKS | CPU_TIERED_JIT);
 	cpu->cpu_flags |= flags;
 	// XXX: eventually, the user should be able to set the instruction formatting
 	set_instr_format(cpu);
@@ -256,6 +264,40 @@ cpu_set_flags(cpu_t *cpu, uint32_t flags)
 	return lc86_status::success;
 }
 
+/*
+* cpu_set_code_cache_budget -> sets how many tc's and how much jitted code the code cache can hold. When either limit is reached, the least recently used tc's
+* are evicted from the cache. Only call this before cpu_run
+* cpu: a valid cpu instance
+* max_tc: maximum number of tc's, must be less than 32768
+* max_code_size: maximum size in bytes of the jitted code of the tc's, or zero for no limit
+* ret: the status of the operation
+*/
+lc86_status
+cpu_set_code_cache_budget(cpu_t *cpu, uint32_t max_tc, size_t max_code_size)
+{
+	if ((max_tc == 0) || (max_tc >= CODE_CACHE_MAX_SIZE)) {
+		return set_last_error(lc86_status::invalid_parameter);
+	}
+
+	cpu->code_cache.set_budget(max_tc, max_code_size ? max_code_size : std::numeric_limits<size_t>::max());
+
+	return lc86_status::success;
+}
+
+/*
+* cpu_set_tc_file -> sets the file of the persistent translation cache. The tc's saved in it by a previous run of the same build of the library are loaded
+* instead of translating their guest code again, if it didn't change, and the new tc's are saved to it. Only call this before cpu_run.
+* The file contains host code that is executed as is, so it must be a trusted input: its entries are only checked against accidental corruption
+* cpu: a valid cpu instance
+* path: path of the file, which is created if it doesn't exist, or nullptr to stop using the file
+* ret: the status of the operation
+*/
+lc86_status
+cpu_set_tc_file(cpu_t *cpu, const char *path)
+{
+	return tc_file_open(cpu, path);
+}
+
 // NOTE: this function uses should_int in the same manner as the memory APIs when when the gate status changes.
 
 /*
@@ -438,7 +480,7 @@ mem_init_region_ram(cpu_t *cpu, addr_t start, size_t size, bool should_int)
 		if (auto ram = as_memory_search_addr(cpu, cpu->ram_start); ram->type == mem_type::ram) {
 			cpu->memory_space_tree->erase(ram->start, ram->end);
 		}
-		cpu->ram_start = start;
+		tc_smc_set_ram_start(cpu, start);
 		cpu->memory_space_tree->insert(std::move(ram));
 		tc_should_clear_cache_and_tlb<true>(cpu, start, start + size - 1);
 	}
@@ -899,7 +941,7 @@ void
 tlb_invalidate(cpu_t *cpu, addr_t addr_start, addr_t addr_end)
 {
 	for (uint32_t tlb_idx_s = addr_start >> PAGE_SHIFT, tlb_idx_e = addr_end >> PAGE_SHIFT; tlb_idx_s <= tlb_idx_e; tlb_idx_s++) {
-		cpu->cpu_ctx.tlb[tlb_idx_s] = (cpu->cpu_ctx.tlb[tlb_idx_s] & ~TLB_VALID);
+		tlb_clear(cpu, tlb_idx_s, TLB_VALID);
 	}
 }
 
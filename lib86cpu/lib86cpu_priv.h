@@ -6,14 +6,29 @@
 
 #pragma once
 
-#include <forward_list>
 #include <unordered_set>
 #include <bitset>
+#include <fstream>
 #include "lib86cpu.h"
 
 
 #define CODE_CACHE_MAX_SIZE (1 << 15)
+#define CODE_CACHE_TABLE_SIZE (CODE_CACHE_MAX_SIZE << 1)
 #define TLB_MAX_SIZE (1 << 20)
+#ifdef LIB86CPU_COMPACT_TLB
+#define TLB_NUM_SLOTS (1 << 10)
+#define TLB_TAG_EMPTY 1 // tags are page addresses, so they can never have this bit set
+#define TLB_MAX_SUBPAGES (TLB_NUM_SLOTS * 4)
+#endif
+#define IBTC_MAX_SIZE (1 << 12)
+#define IBTC_INVALID_FLAGS 0xFFFFFFFF
+#define RSB_MAX_SIZE (1 << 5)
+#define TRACE_MAX_JMP 8
+#define TC_HOT_THRESHOLD 16 // number of runs after which a tier 0 tc is translated again with the full tier
+#define SMC_GRANULE_SHIFT 6 // each bit of cpu_ctx_t::smc tracks 64 bytes of a physical page
+#define SMC_MAX_WRITE_SIZE 4 // biggest write that the jitted code checks against cpu_ctx_t::smc, see tc_smc_page_mask
+#define TC_CODE_NO_JMP 0xFFFFFFFF
+#define PDE_CACHE_SIZE (1 << 10) // one entry for each pde of the page directory
 
  // used to generate the parity table
  // borrowed from Bit Twiddling Hacks by Sean Eron Anderson (public domain)
@@ -67,6 +82,18 @@ struct subpage_t {
 	std::unique_ptr<uint16_t[]> cached_region_idx;
 };
 
+// Caches where the page walk of mmu_translate_addr finds a pde and its page table, so that it doesn't need to search the memory regions for them.
+// Only host pointers are kept, and the pde and the pte are always read again through them, so that the writes to the page directory and to the
+// page tables are seen by the next walk. An entry is only valid when gen is equal to cpu_t::pde_cache_gen, see pde_cache_flush
+// pde_ptr: host address of the pde, or nullptr if it's not in ram
+// pt_addr/pt_ptr: phys and host address of the page table of the pde, or nullptr if it's not entirely in ram
+struct pde_cache_t {
+	uint32_t gen;
+	addr_t pt_addr;
+	uint8_t *pde_ptr;
+	uint8_t *pt_ptr;
+};
+
 struct exp_data_t {
 	uint32_t fault_addr;    // addr that caused the exception
 	uint16_t code;          // error code used by the exception (if any)
@@ -81,24 +108,97 @@ struct exp_info_t {
 
 struct cpu_ctx_t;
 struct translated_code_t;
+
+// An edge of the direct linking graph, that is, the patchable jmp jmp_idx of tc. A null tc marks the end of a list
+struct tc_link_t {
+	translated_code_t *tc;
+	uint32_t jmp_idx;
+};
+
 using entry_t = translated_code_t *(*)(cpu_ctx_t *cpu_ctx);
 using clear_int_t = void (*)(cpu_ctx_t *cpu_ctx);
 using raise_int_t = void (*)(cpu_ctx_t *cpu_ctx, uint32_t int_flg);
+using run_code_t = translated_code_t *(*)(cpu_ctx_t *cpu_ctx, entry_t code);
 
 // jmp_offset functions: 0,1 -> used for direct linking (either points to exit or &next_tc), 2 -> exit
+// jmp_rel32: 0,1 -> displacement of the patchable jmp used for direct linking, or nullptr if the tc doesn't have it
+// pc2: physical address of the second page of a tc whose last instr crosses pages, see tc_crosses_page
+// gen: value of the generation counter of the code cache when the tc was last inserted, found by a search or seen as referenced by get_cold_tc, used to evict
+// the least recently used tc's
+// cache_idx: slot of the tc in the table of the code cache, so that erasing it doesn't need to probe the table
+// num_exec: runs left before a tier 0 tc becomes hot. It's decremented by the prologue of the tc, see gen_prologue_main
+// referenced: set by the prologue of the tc every time it runs, also when it's reached through a link, the ibtc or the rsb, and cleared by get_cold_tc
+// linked_tc: first incoming edge of the list of the tc's whose patchable jmp is linked to this tc
+// link_dst: 0,1 -> tc the patchable jmp is linked to, or nullptr if it's not linked
+// link_prev/next: 0,1 -> neighbours of the patchable jmp in the incoming list of link_dst
 struct translated_code_t {
-	std::forward_list<translated_code_t *> linked_tc;
+	tc_link_t linked_tc;
+	translated_code_t *link_dst[2];
+	tc_link_t link_prev[2];
+	tc_link_t link_next[2];
 	addr_t cs_base;
 	addr_t pc;
+	addr_t pc2;
 	addr_t virt_pc;
 	uint32_t cpu_flags;
 	entry_t ptr_code;
 	entry_t jmp_offset[3];
+	uint8_t *jmp_rel32[2];
 	uint32_t flags;
 	uint32_t size;
+	uint32_t code_size;
+	uint64_t gen;
+	uint32_t cache_idx;
+	int32_t num_exec;
+	uint8_t referenced;
 	explicit translated_code_t() noexcept;
 };
 
+// Translation cache. The tc's are allocated from an arena of CODE_CACHE_MAX_SIZE entries, and the cached ones are indexed by a flat table which is searched
+// with linear probing, starting from tc_hash of the whole tc key. Erased tc's leave a tombstone in the table, which is rebuilt when too many of them accumulate.
+// The cached tc's are also kept within a budget of tc's and bytes of jitted code, which is enforced by evicting the tc's returned by get_cold_tc
+class code_cache_t {
+public:
+	code_cache_t();
+	translated_code_t *alloc();
+	void release(translated_code_t *tc);
+	template<typename F>
+	translated_code_t *search(addr_t pc, addr_t cs_base, uint32_t cpu_flags, F &&is_valid);
+	void insert(translated_code_t *tc);
+	void erase(translated_code_t *tc);
+	void clear();
+	bool full() { return m_free.empty(); }
+	void set_budget(uint32_t max_tc, size_t max_code_size) { m_max_tc = max_tc; m_max_code_size = max_code_size; }
+	bool over_budget() { return (m_num_tc >= m_max_tc) || (m_code_size >= m_max_code_size); }
+	std::vector<translated_code_t *> get_cold_tc();
+
+private:
+	void rehash();
+
+	std::unique_ptr<translated_code_t[]> m_arena;
+	std::vector<translated_code_t *> m_free;
+	std::unique_ptr<translated_code_t *[]> m_table;
+	uint32_t m_num_used; // number of slots in the table that are not empty, including tombstones
+	uint32_t m_num_tc;
+	size_t m_code_size;
+	uint32_t m_max_tc;
+	size_t m_max_code_size;
+	uint64_t m_gen;
+};
+
+// The tc's that have guest code in a physical page. Their code ranges in the page are kept sorted by start offset, so that a write only needs to check the
+// ranges that start at most max_len bytes before it, see tc_page_for_each. Traces can have code anywhere in the page, so they are kept apart
+struct tc_page_t {
+	struct range_t {
+		uint16_t start;
+		uint16_t len;
+		translated_code_t *tc;
+	};
+	std::vector<range_t> ranges;
+	std::vector<translated_code_t *> traces;
+	uint16_t max_len = 0;
+};
+
 struct disas_ctx_t {
 	uint8_t flags;
 	addr_t virt_pc, pc;
@@ -106,6 +206,17 @@ struct disas_ctx_t {
 	exp_data_t exp_data;
 };
 
+// entry of the inline indirect branch target cache and of the return stack buffer, which are probed by the jitted code before calling link_indirect_handler
+struct ibtc_entry_t {
+	addr_t virt_pc;
+	addr_t cs_base;
+	uint32_t cpu_flags = IBTC_INVALID_FLAGS; // no tc can have these flags, so this marks an empty entry
+	entry_t ptr_code;
+};
+
+// the jitted code indexes the ibtc and the rsb with a 3 * 8 scale
+static_assert(sizeof(ibtc_entry_t) == 24);
+
 // the lazy eflags idea comes from reading these two papers:
 // How Bochs Works Under the Hood (2nd edition) http://bochs.sourceforge.net/How%20the%20Bochs%20works%20under%20the%20hood%202nd%20edition.pdf
 // A Proposal for Hardware-Assisted Arithmetic Overflow Detection for Array and Bitfield Operations http://www.emulators.com/docs/LazyOverflowDetect_Final.pdf
@@ -116,21 +227,79 @@ struct lazy_eflags_t {
 	uint8_t parity[256] = { GEN_TABLE };
 };
 
+#ifdef LIB86CPU_COMPACT_TLB
+// A slot of the compact tlb, which caches the tlb entry of the page at address tag, or of no page if tag is TLB_TAG_EMPTY. Pages are mapped to the slots
+// by the low bits of their page number
+struct tlb_slot_t {
+	addr_t tag;
+	uint32_t entry;
+};
+#endif
+
 // this struct should contain all cpu variables which need to be visible from the jitted code
 struct cpu_ctx_t {
 	cpu_t *cpu;
 	regs_t regs;
 	lazy_eflags_t lazy_eflags;
 	uint32_t hflags;
+#ifdef LIB86CPU_COMPACT_TLB
+	tlb_slot_t tlb[TLB_NUM_SLOTS];
+	uintptr_t tlb_addend[TLB_NUM_SLOTS]; // host address of a ram or rom page minus its virtual address, indexed like tlb
+#else
 	uint32_t tlb[TLB_MAX_SIZE];
+	uintptr_t tlb_addend[TLB_MAX_SIZE]; // host address of a ram or rom page minus its virtual address, indexed like tlb
+#endif
 	uint8_t *ram;
 	exp_info_t exp_info;
 	uint32_t int_pending;
+	ibtc_entry_t ibtc[IBTC_MAX_SIZE];
+	ibtc_entry_t rsb[RSB_MAX_SIZE];
+	uint32_t rsb_top;
+	uint64_t *smc; // granules of each ram page that can be overlapped by a write to translated code, see tc_smc_page and tc_smc_page_mask
+	uint32_t smc_first_page; // page number of cpu_t::ram_start, which is the page of smc[0]
 };
 
 // int_pending must be 4 byte aligned to ensure atomicity
 static_assert(alignof(decltype(cpu_ctx_t::int_pending)) == 4);
 
+// A fix up of the code of a tc. offset: end of the call rel32 or of the mov imm64 to fix up, val: offset of the target from what the type refers to
+struct tc_reloc_t {
+	enum type_t : uint32_t {
+		call, // call rel32 to a helper of the library
+		cpu,  // pointer to a member of the cpu_t
+		tc,   // pointer to a member of the tc
+		lib,  // pointer to the code or data of the library
+	};
+	uint32_t offset;
+	type_t type;
+	uint64_t val;
+};
+
+// Code of a tc that doesn't depend on where it's placed, see lc86_jit::get_code_block
+// code_size: size of the code reported to the unwinder
+// jmp_rel32: 0,1 -> offset of the displacement of the patchable jmp, or TC_CODE_NO_JMP
+struct tc_code_t {
+	std::vector<uint8_t> code;
+	uint32_t code_size;
+	uint32_t jmp_rel32[2];
+	std::vector<tc_reloc_t> relocs;
+};
+
+// A tc of the persistent translation cache, see tc_file_open. jit_flags: flags of cpu_t::cpu_flags that change the generated code,
+// guest_hash: hash of the guest code of the tc, see tc_file_hash, code_hash: hash of the host code and of its relocations, see tc_file_code_hash
+struct tc_file_entry_t {
+	addr_t pc;
+	addr_t virt_pc;
+	addr_t cs_base;
+	uint32_t cpu_flags;
+	uint32_t flags;
+	uint32_t jit_flags;
+	uint32_t size;
+	uint64_t guest_hash;
+	uint64_t code_hash;
+	tc_code_t code;
+};
+
 class lc86_jit;
 struct cpu_t {
 	uint32_t cpu_flags;
@@ -140,16 +309,26 @@ struct cpu_t {
 	std::unique_ptr<lc86_jit> jit;
 	std::unique_ptr<address_space<addr_t>> memory_space_tree;
 	std::unique_ptr<address_space<port_t>> io_space_tree;
-	std::list<std::unique_ptr<translated_code_t>> code_cache[CODE_CACHE_MAX_SIZE];
-	std::unordered_map<uint32_t, std::unordered_set<translated_code_t *>> tc_page_map;
+	code_cache_t code_cache;
+	std::vector<entry_t> dead_code; // code of the tc's erased from the code cache, which is freed by tc_free_dead_code
+	std::vector<tc_link_t> hot_links; // edges that were linked to the hot tc being translated again by cpu_main_loop
+	std::unordered_map<uint32_t, tc_page_t> tc_page_map;
+	std::unordered_multimap<addr_t, tc_file_entry_t> tc_file_map; // tc's of the persistent translation cache indexed by pc, see tc_file_open
+	std::ofstream tc_file;
+	uint32_t tc_file_unflushed; // entries appended to tc_file since it was last flushed
 	std::unordered_map<addr_t, translated_code_t *> ibtc;
 	std::unordered_map<addr_t, void *> hook_map;
 	std::vector<subpage_t> subpages;
+#ifndef LIB86CPU_COMPACT_TLB
+	std::vector<uint32_t> tlb_used; // indices of the tlb entries that can be non zero, see tlb_flush
+	std::bitset<TLB_MAX_SIZE> tlb_used_map; // bit set for each index in tlb_used
+#endif
+	pde_cache_t pde_cache[PDE_CACHE_SIZE]; // indexed by the top ten bits of the virtual address
+	uint32_t pde_cache_gen;
 	std::vector<std::pair<bool, std::unique_ptr<memory_region_t<addr_t>>>> regions_changed;
 	std::vector<const memory_region_t<addr_t> *> cached_regions;
 	std::bitset<std::numeric_limits<port_t>::max() + 1> iotable;
 	std::atomic_flag suspend_flg;
-	uint16_t num_tc;
 	struct {
 		uint64_t tsc;
 		static constexpr uint64_t freq = 733333333;
@@ -159,17 +338,23 @@ struct cpu_t {
 	msr_t msr;
 	clear_int_t clear_int_fn;
 	raise_int_t raise_int_fn;
+	run_code_t run_code_fn;
 	fp_int get_int_vec;
 	std::string dbg_name;
 	addr_t bp_addr;
 	addr_t db_addr;
 	addr_t instr_eip;
 	addr_t virt_pc;
+	addr_t trace_pc;
 	addr_t ram_start;
+	size_t ram_size;
 	size_t instr_bytes;
 	uint8_t size_mode;
 	uint8_t addr_mode;
 	uint8_t translate_next;
+	uint8_t trace_next;
+	uint8_t trace_len;
+	uint8_t instr_flags_dead;
 	uint32_t a20_mask;
 	uint32_t new_a20;
 };
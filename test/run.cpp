@@ -18,6 +18,10 @@ options: \n\
 -i         Use Intel syntax (default is AT&T)\n\
 -d         Start with debugger\n\
 -t <num>   Run a test specified by num\n\
+-j         Translate the code with the cheap tier first (CPU_TIERED_JIT)\n\
+-b <num>   Limit the code cache to num translated blocks, so that they are evicted all the time\n\
+-c <path>  Save the translated blocks to the cache file at path, and load them from it. With test 0, test386.asm\n\
+           is run several times with the same file, and with corrupted entries\n\
 -h         Print this message\n";
 
 	printf("%s", help);
@@ -53,13 +57,43 @@ logger(log_level lv, const unsigned count, const char *msg, ...)
 	}
 }
 
+bool
+run_cpu(uint32_t flags, uint32_t max_tc, const char *tc_file)
+{
+	// runs the cpu created by a test with the options of the command line, and frees it when the emulation terminates
+	cpu_set_flags(cpu, flags);
+	if (max_tc && !LC86_SUCCESS(cpu_set_code_cache_budget(cpu, max_tc, 0))) {
+		printf("Failed to set the budget of the code cache!\n");
+		cpu_free(cpu);
+		cpu = nullptr;
+		return false;
+	}
+
+	if (tc_file && !LC86_SUCCESS(cpu_set_tc_file(cpu, tc_file))) {
+		printf("Failed to open the translation cache file \"%s\"!\n", tc_file);
+		cpu_free(cpu);
+		cpu = nullptr;
+		return false;
+	}
+
+	lc86_status code = cpu_run(cpu);
+	std::printf("Emulation terminated with status %d. The error was \"%s\"\n", code, get_last_error().c_str());
+	cpu_free(cpu);
+	cpu = nullptr;
+
+	return true;
+}
+
 int
 main(int argc, char **argv)
 {
 	std::string executable;
 	int intel_syntax = 0;
 	int use_dbg = 0;
+	int tiered_jit = 0;
 	int test_num = -1;
+	uint32_t max_tc = 0;
+	std::string tc_file;
 
 	/* parameter parsing */
 	if (argc < 2) {
@@ -81,6 +115,10 @@ main(int argc, char **argv)
 					use_dbg = 1;
 					break;
 
+				case 'j':
+					tiered_jit = 1;
+					break;
+
 				case 't':
 					if (++idx == argc || argv[idx][0] == '-') {
 						printf("Missing argument for option \"t\"\n");
@@ -89,6 +127,22 @@ main(int argc, char **argv)
 					test_num = std::stoi(std::string(argv[idx]), nullptr, 0);
 					break;
 
+				case 'b':
+					if (++idx == argc || argv[idx][0] == '-') {
+						printf("Missing argument for option \"b\"\n");
+						return 0;
+					}
+					max_tc = std::stoul(std::string(argv[idx]), nullptr, 0);
+					break;
+
+				case 'c':
+					if (++idx == argc || argv[idx][0] == '-') {
+						printf("Missing argument for option \"c\"\n");
+						return 0;
+					}
+					tc_file = argv[idx];
+					break;
+
 				case 'h':
 					print_help();
 					return 0;
@@ -109,13 +163,18 @@ main(int argc, char **argv)
 				return 0;
 			}
 		}
-		/* handle possible exceptions thrown by std::stoi */
+		/* handle possible exceptions thrown by std::stoi and std::stoul */
 		catch (std::exception &e) {
-			printf("Failed to parse \"t\" option. The error was: %s\n", e.what());
+			printf("Failed to parse the argument of option \"%s\". The error was: %s\n", argv[idx - 1], e.what());
 			return 1;
 		}
 	}
 
+	uint32_t flags = (intel_syntax ? CPU_INTEL_SYNTAX : 0) | (use_dbg ? CPU_DBG_PRESENT : 0) | (tiered_jit ? CPU_TIERED_JIT : 0);
+	if ((test_num == 0) && !tc_file.empty()) {
+		return run_test386asm_tc_file_test(executable, tc_file, flags, max_tc) ? 0 : 1;
+	}
+
 	switch (test_num)
 	{
 	case 0:
@@ -154,17 +213,30 @@ main(int argc, char **argv)
 		}
 		break;
 
+	case 4:
+		if (gen_smc_test() == false) {
+			if (cpu) {
+				cpu_free(cpu);
+			}
+			return 1;
+		}
+		break;
+
 	default:
 		printf("Unknown test option specified\n");
 		return 1;
 	}
 
 	register_log_func(logger);
-	cpu_set_flags(cpu, (intel_syntax ? CPU_INTEL_SYNTAX : 0) | (use_dbg ? CPU_DBG_PRESENT : 0));
+	if (!run_cpu(flags, max_tc, tc_file.empty() ? nullptr : tc_file.c_str())) {
+		return 1;
+	}
 
-	lc86_status code = cpu_run(cpu);
-	std::printf("Emulation terminated with status %d. The error was \"%s\"\n", code, get_last_error().c_str());
-	cpu_free(cpu);
+	// test386.asm and the smc test end with a hlt, which terminates the emulation, so only what they wrote to their ports tells if they passed
+	if (((test_num == 0) && !test386asm_passed()) || ((test_num == 4) && !smc_test_passed())) {
+		printf("The test failed\n");
+		return 1;
+	}
 
 	return 0;
 }
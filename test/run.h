@@ -5,7 +5,13 @@
 
 inline cpu_t *cpu = nullptr;
 
+bool run_cpu(uint32_t flags, uint32_t max_tc, const char *tc_file);
+
 bool gen_test386asm_test(const std::string &executable);
+bool test386asm_passed();
+bool run_test386asm_tc_file_test(const std::string &executable, const std::string &tc_file, uint32_t flags, uint32_t max_tc);
 bool gen_hook_test();
 bool gen_dbg_test();
 bool gen_cxbxrkrnl_test(const std::string &executable);
+bool gen_smc_test();
+bool smc_test_passed();
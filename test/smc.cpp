@@ -0,0 +1,126 @@
+/*
+ * lib86cpu self-modifying code test generator
+ *
+ * ergo720                Copyright (c) 2026
+ */
+
+#include "run.h"
+#include <cstring>
+
+#define SMC_RESULT_PORT 0x80
+#define SMC_STALE_PORT  0x81
+
+
+// memory map
+// 00000-00048 code
+// 01200-01202 fn, in another page so that the code above never traces into it
+// 01400-01403 data, in the page of fn but not in its 64 byte granule
+// 02000-02FFF stack
+//
+// The guest calls fn and writes the value it returns to SMC_RESULT_PORT. A write to SMC_STALE_PORT changes the code of fn from the host, without telling
+// lib86cpu, so the value returned by fn from then on tells if its tc was invalidated. This relies on the tc of fn not being evicted, so don't use -b with it:
+//
+// mov dx, 0x80
+// call fn                         ; 1
+// out dx, al
+// out 0x81, al                    ; fn becomes mov al, 2 behind the back of lib86cpu
+// call fn                         ; 1, the tc of fn is still used
+// out dx, al
+// mov dword [0x1400], 0x12345678  ; data write in the page of fn, outside of its granules
+// call fn                         ; 1, the tc of fn must not be invalidated
+// out dx, al
+// mov byte [0x1201], 4            ; write to the code of fn
+// call fn                         ; 4, the tc of fn must be invalidated
+// out dx, al
+// out 0x81, al
+// call fn                         ; 4
+// out dx, al
+// mov dword [0x11FE], 0x03B09090  ; write that starts two bytes before fn and ends in it
+// call fn                         ; 3, the tc of fn must be invalidated
+// out dx, al
+// cli
+// hlt
+//
+// fn:
+// mov al, 1
+// ret
+static uint8_t smc_binary[] = {
+	0x66, 0xBA, 0x80, 0x00, 0xE8, 0xF7, 0x11, 0x00, 0x00, 0xEE, 0xE6, 0x81,
+	0xE8, 0xEF, 0x11, 0x00, 0x00, 0xEE, 0xC7, 0x05, 0x00, 0x14, 0x00, 0x00,
+	0x78, 0x56, 0x34, 0x12, 0xE8, 0xDF, 0x11, 0x00, 0x00, 0xEE, 0xC6, 0x05,
+	0x01, 0x12, 0x00, 0x00, 0x04, 0xE8, 0xD2, 0x11, 0x00, 0x00, 0xEE, 0xE6,
+	0x81, 0xE8, 0xCA, 0x11, 0x00, 0x00, 0xEE, 0xC7, 0x05, 0xFE, 0x11, 0x00,
+	0x00, 0x90, 0x90, 0xB0, 0x03, 0xE8, 0xBA, 0x11, 0x00, 0x00, 0xEE, 0xFA,
+	0xF4
+};
+
+static uint8_t smc_fn[] = {
+	0xB0, 0x01, 0xC3
+};
+
+static const std::vector<uint8_t> smc_expected = { 1, 1, 1, 4, 4, 3 };
+static std::vector<uint8_t> smc_results;
+
+
+static void
+smc_write_handler(addr_t addr, const uint8_t value, void *opaque)
+{
+	switch (addr)
+	{
+	case SMC_RESULT_PORT:
+		std::printf("fn returned %u\n", value);
+		smc_results.push_back(value);
+		break;
+
+	case SMC_STALE_PORT:
+		get_ram_ptr(cpu)[0x1201] = 2;
+		break;
+
+	default:
+		std::printf("Unhandled i/o write at port %d\n", addr);
+	}
+}
+
+bool
+smc_test_passed()
+{
+	return smc_results == smc_expected;
+}
+
+bool
+gen_smc_test()
+{
+	size_t ramsize = 3 * 4096;
+	smc_results.clear();
+
+	if (!LC86_SUCCESS(cpu_new(ramsize, cpu))) {
+		std::printf("Failed to initialize lib86cpu!\n");
+		return false;
+	}
+
+	uint8_t *ram = get_ram_ptr(cpu);
+	std::memcpy(ram, smc_binary, sizeof(smc_binary));
+	std::memcpy(ram + 0x1200, smc_fn, sizeof(smc_fn));
+
+	if (!LC86_SUCCESS(mem_init_region_ram(cpu, 0, ramsize))) {
+		std::printf("Failed to initialize ram memory for smc test!\n");
+		return false;
+	}
+
+	if (!LC86_SUCCESS(mem_init_region_io(cpu, SMC_RESULT_PORT, 2, true, io_handlers_t{ .fnw8 = smc_write_handler }, nullptr))) {
+		std::printf("Failed to initialize i/o ports for smc test!\n");
+		return false;
+	}
+
+	regs_t *regs = get_regs_ptr(cpu);
+	regs->cr0 |= 1;
+	regs->eip = 0;
+	regs->cs = 0;
+	regs->cs_hidden.base = 0;
+	regs->cs_hidden.flags = 1 << 22;
+	regs->ss_hidden.flags = 1 << 22;
+	regs->esp = ramsize;
+	regs->ebp = ramsize;
+
+	return true;
+}
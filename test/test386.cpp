@@ -6,10 +6,31 @@
 
 #include "run.h"
 #include <fstream>
+#include <cstdarg>
+#include <cstring>
+#include <cstdio>
+#include <iterator>
+#include <array>
+#include <set>
 
 #define TEST386_POST_PORT 0x190
 #define TEST386_EE_PORT 0x55
+#define TEST386_POST_DONE 0xFF // last post code, written when all the tests passed
 
+// layout of the translation cache file, see tc_file_open and tc_file_write_entry in lib86cpu
+#define TC_FILE_VERSION          2
+#define TC_FILE_HDR_SIZE         16
+#define TC_FILE_ENTRY_JIT_FLAGS  20
+#define TC_FILE_ENTRY_GUEST_HASH 28
+#define TC_FILE_ENTRY_CODE_HASH  36
+#define TC_FILE_ENTRY_CODE_SIZE  44
+#define TC_FILE_ENTRY_CODE_LEN   56
+#define TC_FILE_ENTRY_NUM_RELOCS 60
+#define TC_FILE_ENTRY_SIZE       64 // size of an entry without its code and relocations
+#define TC_FILE_RELOC_SIZE       16
+
+static uint8_t test386_post;
+static size_t tc_file_loaded;
 
 static void
 test386_write_handler(addr_t addr, const uint8_t value, void *opaque)
@@ -18,6 +39,7 @@ test386_write_handler(addr_t addr, const uint8_t value, void *opaque)
 	{
 	case TEST386_POST_PORT:
 		printf("Test number is 0x%X\n", static_cast<const uint8_t>(value));
+		test386_post = value;
 		break;
 
 	case TEST386_EE_PORT: {
@@ -37,11 +59,18 @@ test386_write_handler(addr_t addr, const uint8_t value, void *opaque)
 	}
 }
 
+bool
+test386asm_passed()
+{
+	return test386_post == TEST386_POST_DONE;
+}
+
 bool
 gen_test386asm_test(const std::string &executable)
 {
 	addr_t code_start = 0xF0000;
 	size_t ramsize = 1 * 1024 * 1024;
+	test386_post = 0;
 
 	/* load code */
 	std::ifstream ifs(executable, std::ios_base::in | std::ios_base::binary);
@@ -95,3 +124,197 @@ gen_test386asm_test(const std::string &executable)
 
 	return true;
 }
+
+static void
+tc_file_logger(log_level lv, const unsigned count, const char *msg, ...)
+{
+	// remembers how many entries tc_file_open loaded from the file, from the message it logs after loading it
+	std::va_list args;
+	va_start(args, msg);
+	if ((count == 2) && (std::strncmp(msg, "Loaded %zu translated blocks", 28) == 0)) {
+		tc_file_loaded = va_arg(args, size_t);
+	}
+	va_end(args);
+}
+
+template<typename T>
+static T
+tc_file_get(const std::vector<uint8_t> &file, size_t offset)
+{
+	T val;
+	std::memcpy(&val, &file[offset], sizeof(T));
+	return val;
+}
+
+template<typename T>
+static void
+tc_file_set(std::vector<uint8_t> &file, size_t offset, T val)
+{
+	std::memcpy(&file[offset], &val, sizeof(T));
+}
+
+static bool
+tc_file_parse(const std::string &tc_file, std::vector<uint8_t> &file, std::vector<size_t> &entries)
+{
+	// reads the whole file and finds where its entries start
+	std::ifstream ifs(tc_file, std::ios_base::in | std::ios_base::binary);
+	if (!ifs.is_open()) {
+		printf("Could not open the translation cache file \"%s\"!\n", tc_file.c_str());
+		return false;
+	}
+	file.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+
+	if ((file.size() < TC_FILE_HDR_SIZE) || (tc_file_get<uint32_t>(file, 4) != TC_FILE_VERSION)) {
+		printf("The translation cache file \"%s\" has an unknown format!\n", tc_file.c_str());
+		return false;
+	}
+
+	entries.clear();
+	for (size_t offset = TC_FILE_HDR_SIZE; offset < file.size();) {
+		if ((file.size() - offset) < TC_FILE_ENTRY_SIZE) {
+			printf("The translation cache file \"%s\" is truncated!\n", tc_file.c_str());
+			return false;
+		}
+		entries.push_back(offset);
+		offset += TC_FILE_ENTRY_SIZE + tc_file_get<uint32_t>(file, offset + TC_FILE_ENTRY_CODE_LEN) +
+			static_cast<size_t>(tc_file_get<uint32_t>(file, offset + TC_FILE_ENTRY_NUM_RELOCS)) * TC_FILE_RELOC_SIZE;
+	}
+
+	if (entries.empty()) {
+		printf("The translation cache file \"%s\" has no entries!\n", tc_file.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+static size_t
+tc_file_num_tc(const std::vector<uint8_t> &file, const std::vector<size_t> &entries, size_t num_entries)
+{
+	// number of different tc's in the first num_entries entries, which is how many tc_file_open loads, since it only keeps the newest entry of a tc
+	std::set<std::array<uint32_t, 5>> keys;
+	for (size_t i = 0; i < num_entries; ++i) {
+		size_t entry = entries[i];
+		keys.insert({ tc_file_get<uint32_t>(file, entry), tc_file_get<uint32_t>(file, entry + 4), tc_file_get<uint32_t>(file, entry + 8),
+			tc_file_get<uint32_t>(file, entry + 12), tc_file_get<uint32_t>(file, entry + TC_FILE_ENTRY_JIT_FLAGS) });
+	}
+
+	return keys.size();
+}
+
+static bool
+tc_file_write_all(const std::string &tc_file, const std::vector<uint8_t> &file)
+{
+	std::ofstream ofs(tc_file, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+	return static_cast<bool>(ofs.write(reinterpret_cast<const char *>(file.data()), file.size()));
+}
+
+static uint64_t
+tc_file_code_hash(const std::vector<uint8_t> &file, size_t entry)
+{
+	// same hash of tc_file_code_hash in lib86cpu: code, code_size and jmp_rel32, then the relocations, which are stored with the same layout right after the code
+	uint32_t code_len = tc_file_get<uint32_t>(file, entry + TC_FILE_ENTRY_CODE_LEN);
+	size_t relocs_size = static_cast<size_t>(tc_file_get<uint32_t>(file, entry + TC_FILE_ENTRY_NUM_RELOCS)) * TC_FILE_RELOC_SIZE;
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	const auto hash_bytes = [&hash, &file](size_t offset, size_t size) {
+		for (size_t i = offset; i < (offset + size); ++i) {
+			hash = (hash ^ file[i]) * 0x100000001B3ULL;
+		}
+	};
+
+	hash_bytes(entry + TC_FILE_ENTRY_SIZE, code_len);
+	hash_bytes(entry + TC_FILE_ENTRY_CODE_SIZE, 12);
+	hash_bytes(entry + TC_FILE_ENTRY_SIZE + code_len, relocs_size);
+
+	return hash;
+}
+
+static void
+tc_file_poison_code(std::vector<uint8_t> &file, size_t entry)
+{
+	// replaces the host code of the entry with int3, so that the test crashes if the entry is ever run
+	uint32_t code_len = tc_file_get<uint32_t>(file, entry + TC_FILE_ENTRY_CODE_LEN);
+	std::memset(&file[entry + TC_FILE_ENTRY_SIZE], 0xCC, code_len);
+}
+
+static bool
+run_test386asm_pass(const std::string &executable, const std::string &tc_file, uint32_t flags, uint32_t max_tc, const char *pass)
+{
+	printf("test386.asm with the translation cache file: %s\n", pass);
+	tc_file_loaded = 0;
+	if (!gen_test386asm_test(executable)) {
+		if (cpu) {
+			cpu_free(cpu);
+			cpu = nullptr;
+		}
+		return false;
+	}
+
+	if (!run_cpu(flags, max_tc, tc_file.c_str())) {
+		return false;
+	}
+
+	if (!test386asm_passed()) {
+		printf("test386.asm failed\n");
+		return false;
+	}
+
+	return true;
+}
+
+bool
+run_test386asm_tc_file_test(const std::string &executable, const std::string &tc_file, uint32_t flags, uint32_t max_tc)
+{
+	// Runs test386.asm four times with the same translation cache file, which must pass every time:
+	// 1. with a new file, which saves all the tc's
+	// 2. again, which must load all the tc's saved by the first run. The runs also check the number of tc's loaded by tc_file_open
+	// 3. with the host code of the last entry corrupted, which tc_file_read_entry must reject, while it still loads the entries before it
+	// 4. with the host code of all the entries replaced by int3 and their code_hash fixed, but with a wrong guest_hash. Then all the entries are loaded
+	// by tc_file_open, but tc_file_load must reject all of them, because they don't match the guest code anymore
+	register_log_func(tc_file_logger);
+	std::remove(tc_file.c_str());
+	if (!run_test386asm_pass(executable, tc_file, flags, max_tc, "new file")) {
+		return false;
+	}
+
+	std::vector<uint8_t> file;
+	std::vector<size_t> entries;
+	const auto check_loaded = [&file, &entries](size_t num_entries) {
+		size_t num_tc = tc_file_num_tc(file, entries, num_entries);
+		if (tc_file_loaded != num_tc) {
+			printf("Loaded %zu translated blocks instead of %zu\n", tc_file_loaded, num_tc);
+			return false;
+		}
+		return true;
+	};
+
+	if (!tc_file_parse(tc_file, file, entries) || !run_test386asm_pass(executable, tc_file, flags, max_tc, "reused file") ||
+		!check_loaded(entries.size())) {
+		return false;
+	}
+
+	if (!tc_file_parse(tc_file, file, entries)) {
+		return false;
+	}
+	tc_file_poison_code(file, entries.back());
+	if (!tc_file_write_all(tc_file, file) || !run_test386asm_pass(executable, tc_file, flags, max_tc, "corrupted entry") ||
+		!check_loaded(entries.size() - 1)) {
+		return false;
+	}
+
+	if (!tc_file_parse(tc_file, file, entries)) {
+		return false;
+	}
+	for (size_t entry : entries) {
+		tc_file_poison_code(file, entry);
+		tc_file_set<uint64_t>(file, entry + TC_FILE_ENTRY_CODE_HASH, tc_file_code_hash(file, entry));
+		tc_file_set<uint64_t>(file, entry + TC_FILE_ENTRY_GUEST_HASH, ~tc_file_get<uint64_t>(file, entry + TC_FILE_ENTRY_GUEST_HASH));
+	}
+	if (!tc_file_write_all(tc_file, file) || !run_test386asm_pass(executable, tc_file, flags, max_tc, "changed guest code") ||
+		!check_loaded(entries.size())) {
+		return false;
+	}
+
+	printf("test386.asm passed with the translation cache file\n");
+	return true;
+}